@@ -0,0 +1,111 @@
+/* Copyright (C) 2021-2023 Isaac Liu
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <https://www.gnu.org/licenses/>. */
+
+#include <kern/thread.h>
+#include <sys/errno.h>
+#include <sys/proc.h>
+#include <sys/sysctl.h>
+#include <sys/systm.h>
+#include "e2fsmac.h"
+
+/* Kernel threads that can be waited on, for use by libext2fs */
+
+struct e2fsmac_thread
+{
+  void (*func) (void *);
+  void *arg;
+  lck_mtx_t *mtx;
+  int done;
+};
+
+static void
+thread_main (void *data, wait_result_t wres)
+{
+  struct e2fsmac_thread *thread = data;
+  thread->func (thread->arg);
+
+  lck_mtx_lock (thread->mtx);
+  thread->done = 1;
+  wakeup (thread);
+  lck_mtx_unlock (thread->mtx);
+  thread_terminate (current_thread ());
+}
+
+int
+e2fsmac_thread_create (e2fsmac_thread_t *ret, void (*func) (void *),
+		       void *arg)
+{
+  struct e2fsmac_thread *thread;
+  thread_t kthread;
+
+  thread = e2fsmac_malloc (sizeof *thread, M_ZERO);
+  if (unlikely (!thread))
+    return ENOMEM;
+  thread->mtx = e2fsmac_mutex_alloc ();
+  if (unlikely (!thread->mtx))
+    {
+      e2fsmac_free (thread);
+      return ENOMEM;
+    }
+  thread->func = func;
+  thread->arg = arg;
+
+  if (kernel_thread_start (thread_main, thread, &kthread) != KERN_SUCCESS)
+    {
+      log ("kernel_thread_start(): failed");
+      e2fsmac_mutex_free (thread->mtx);
+      e2fsmac_free (thread);
+      return EAGAIN;
+    }
+  thread_deallocate (kthread);
+  *ret = thread;
+  return 0;
+}
+
+/* Wait for a thread to return and free it */
+
+void
+e2fsmac_thread_join (e2fsmac_thread_t thread)
+{
+  lck_mtx_lock (thread->mtx);
+  while (!thread->done)
+    msleep (thread, thread->mtx, PRIBIO, "e2fsmac_join", NULL);
+  lck_mtx_unlock (thread->mtx);
+
+  e2fsmac_mutex_free (thread->mtx);
+  e2fsmac_free (thread);
+}
+
+lck_mtx_t *
+e2fsmac_mutex_alloc (void)
+{
+  return lck_mtx_alloc_init (ext2_lck_grp, LCK_ATTR_NULL);
+}
+
+void
+e2fsmac_mutex_free (lck_mtx_t *mtx)
+{
+  lck_mtx_free (mtx, ext2_lck_grp);
+}
+
+int
+e2fsmac_ncpus (void)
+{
+  int ncpus;
+  size_t len = sizeof ncpus;
+  if (sysctlbyname ("hw.logicalcpu", &ncpus, &len, NULL, 0) || ncpus < 1)
+    return 1;
+  return ncpus;
+}
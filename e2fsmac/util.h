@@ -20,6 +20,7 @@
 #include <sys/malloc.h>
 #include <sys/vnode.h>
 #include <mach/mach_types.h>
+#include <libkern/locks.h>
 #include <libkern/libkern.h>
 
 #define likely(x)               __builtin_expect (!!(x), 1)
@@ -46,6 +47,15 @@ void kmemassert (void);
 
 time_t get_time (void);
 
+typedef struct e2fsmac_thread *e2fsmac_thread_t;
+
+int e2fsmac_thread_create (e2fsmac_thread_t *thread, void (*func) (void *),
+			   void *arg);
+void e2fsmac_thread_join (e2fsmac_thread_t thread);
+lck_mtx_t *e2fsmac_mutex_alloc (void);
+void e2fsmac_mutex_free (lck_mtx_t *mtx);
+int e2fsmac_ncpus (void);
+
 ssize_t vpread (vnode_t vp, void *buffer, size_t len, off_t offset);
 ssize_t vpwrite (vnode_t vp, const void *buffer, size_t len, off_t offset);
 
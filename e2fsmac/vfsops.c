@@ -213,7 +213,8 @@ ext2_vfsop_mount (struct mount *mp, vnode_t devvp, user_addr_t data,
       goto err0;
     }
 
-  flags = 0;
+  /* 64-bit bitmaps are needed for large volumes and are read in lazily */
+  flags = EXT2_FLAG_64BITS | EXT2_FLAG_THREADS;
   if (!args.readonly)
     flags |= EXT2_FLAG_RW;
   mp_flags = MNT_NOSUID | MNT_NODEV;
@@ -261,6 +262,9 @@ ext2_vfsop_mount (struct mount *mp, vnode_t devvp, user_addr_t data,
       goto err0;
     }
 
+  /* Bitmaps are read on first use, so this still applies to them */
+  emp->fs->default_bitmap_type = EXT2FS_BMAP64_ROARING;
+
   if (flags & EXT2_FLAG_RW)
     {
       emp->fs->super->s_mtime = get_time ();
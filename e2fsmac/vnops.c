@@ -15,8 +15,12 @@
 
 #include <sys/fcntl.h>
 #include <sys/dirent.h>
+#include <sys/ubc.h>
 #include "e2fsmac.h"
 
+/* Maximum number of blocks copied in from a uio per ext2fs_file_write() */
+#define EXT2_WRITE_CHUNK_BLOCKS 64
+
 struct ext2_readdir_private
 {
   uio_t uio;
@@ -137,6 +141,27 @@ uiomove_atomic (void *addr, size_t size, uio_t uio)
   return ret;
 }
 
+static int
+update_mtime (ext2_filsys fs, struct ext2_fsnode *fsnode)
+{
+  struct ext2_inode_large inode;
+  struct ext2_inode_large *pinode;
+  struct timespec now;
+  int ret;
+
+  memset (&inode, 0, sizeof inode);
+  ret = ext2fs_read_inode_full (fs, fsnode->ino, (struct ext2_inode *) &inode,
+				sizeof inode);
+  if (ret)
+    return ret;
+
+  pinode = &inode;
+  nanotime (&now);
+  EXT4_INODE_SET_XTIME (i_mtime, &now, pinode);
+  EXT4_INODE_SET_XTIME (i_ctime, &now, pinode);
+  return update_large_inode (fs, fsnode, pinode);
+}
+
 static int
 ext2_readdir_process (struct ext2_dir_entry *dirent, int offset, int blocksize,
 		      char *buffer, void *data)
@@ -290,6 +315,19 @@ ext2_vnop_lookup (struct vnop_lookup_args *args)
   return TRANSLATE_ERROR (emp->fs, ret, fsnode->ino);
 }
 
+/* Close the file of fsnode, unless its pending data cannot be written
+   out; then it stays open so the data is not lost */
+static int
+close_fsnode_file (struct ext2_fsnode *fsnode)
+{
+  int ret = ext2fs_file_flush (fsnode->file);
+  if (ret)
+    return ret;
+  ret = ext2fs_file_close (fsnode->file);
+  fsnode->file = NULL;
+  return ret;
+}
+
 static int
 ext2_vnop_open (struct vnop_open_args *args)
 {
@@ -304,8 +342,9 @@ ext2_vnop_open (struct vnop_open_args *args)
   if (fsnode->file && fsnode->flags != flags)
     {
       log_debug ("open: freeing ext2_file_t in wrong mode: %p", fsnode->file);
-      ext2fs_file_close (fsnode->file);
-      fsnode->file = NULL;
+      ret = close_fsnode_file (fsnode);
+      if (ret)
+	return TRANSLATE_ERROR (emp->fs, ret, fsnode->ino);
     }
   if (!fsnode->file)
     {
@@ -324,8 +363,16 @@ static int
 ext2_vnop_close (struct vnop_close_args *args)
 {
   vnode_t vp = args->a_vp;
-  log_debug ("close: vnode: %#x", vnode_vid (vp));
-  return 0;
+  struct ext2_mount *emp = vfs_fsprivate (vnode_mount (vp));
+  struct ext2_fsnode *fsnode = vnode_fsnode (vp);
+  int ret = 0;
+
+  /* Report data that cannot be written out now rather than lose it
+     silently when the vnode is reclaimed */
+  if (fsnode && fsnode->file && (fsnode->flags & EXT2_FILE_WRITE))
+    ret = ext2fs_file_flush (fsnode->file);
+  log_debug ("close: vnode: %#x, errno: %d", vnode_vid (vp), ret);
+  return ret ? TRANSLATE_ERROR (emp->fs, ret, fsnode->ino) : 0;
 }
 
 static int
@@ -437,6 +484,120 @@ ext2_vnop_readdir (struct vnop_readdir_args *args)
   return TRANSLATE_ERROR (emp->fs, ret, fsnode->ino);
 }
 
+static int
+ext2_vnop_write (struct vnop_write_args *args)
+{
+  vnode_t vp = args->a_vp;
+  uio_t uio = args->a_uio;
+  int ioflag = args->a_ioflag;
+  struct ext2_mount *emp = vfs_fsprivate (vnode_mount (vp));
+  struct ext2_fsnode *fsnode = vnode_fsnode (vp);
+  ext2_filsys fs = emp->fs;
+  char *buffer = NULL;
+  size_t bufsize;
+  off_t offset;
+  off_t end;
+  __u64 old_size;
+  __u64 written = 0;
+  unsigned int count;
+  unsigned int got;
+  int ret = 0;
+
+  if (!vnode_isreg (vp))
+    {
+      ret = vnode_isdir (vp) ? EISDIR : EPERM;
+      goto out;
+    }
+  if (!(fs->flags & EXT2_FLAG_RW))
+    {
+      ret = EROFS;
+      goto out;
+    }
+
+  if (!fsnode->file || !(fsnode->flags & EXT2_FILE_WRITE))
+    {
+      if (fsnode->file)
+	{
+	  ret = close_fsnode_file (fsnode);
+	  if (ret)
+	    goto out;
+	}
+      ret = ext2_open_vnode (emp, vp, EXT2_FILE_WRITE);
+      if (ret)
+	goto out;
+    }
+
+  ret = ext2fs_file_get_lsize (fsnode->file, &old_size);
+  if (ret)
+    goto out;
+  offset = (ioflag & IO_APPEND) ? (off_t) old_size : uio_offset (uio);
+  if (offset < 0)
+    {
+      ret = EINVAL;
+      goto out;
+    }
+  end = offset + uio_resid (uio);
+  if (end == offset)
+    goto out;
+
+  ret = ext2fs_file_llseek (fsnode->file, offset, EXT2_SEEK_SET, NULL);
+  if (ret)
+    goto out;
+  /* With IO_APPEND the data goes at EOF, wherever the caller was */
+  uio_setoffset (uio, offset);
+
+  bufsize = MIN ((size_t) (end - offset),
+		 (size_t) fs->blocksize * EXT2_WRITE_CHUNK_BLOCKS);
+  buffer = e2fsmac_malloc (bufsize, 0);
+  if (unlikely (!buffer))
+    {
+      ret = ENOMEM;
+      goto out;
+    }
+
+  /* ext2fs_file_write() extends the size as each chunk is copied, so
+     the size never covers data that was not written, and blocks past
+     EOF are allocated by its delayed allocation path in whole runs */
+  while (uio_resid (uio) > 0)
+    {
+      /* Keep every chunk after the first one block-aligned */
+      count = bufsize - (offset + written) % fs->blocksize;
+      if (count > (user_size_t) uio_resid (uio))
+	count = uio_resid (uio);
+      ret = uiomove_atomic (buffer, count, uio);
+      if (ret)
+	break;
+      ret = ext2fs_file_write (fsnode->file, buffer, count, &got);
+      written += got;
+      if (ret || got < count)
+	{
+	  /* Give back what was taken from the uio but not written */
+	  uio_setresid (uio, uio_resid (uio) + (count - got));
+	  uio_setoffset (uio, offset + written);
+	  break;
+	}
+    }
+
+  if (!ret && (ioflag & IO_SYNC))
+    ret = ext2fs_file_flush (fsnode->file);
+
+  if (written)
+    {
+      int ret2;
+      ubc_setsize (vp, EXT2_I_SIZE (fsnode->inode));
+      ret2 = update_mtime (fs, fsnode);
+      if (!ret)
+	ret = ret2;
+    }
+
+  log_debug ("write: vnode: %#x, offset: %lld, written: %llu, errno: %d",
+	     vnode_vid (vp), offset, written, ret);
+
+ out:
+  e2fsmac_free (buffer);
+  return TRANSLATE_ERROR (fs, ret, fsnode->ino);
+}
+
 static int
 ext2_vnop_reclaim (struct vnop_reclaim_args *args)
 {
@@ -448,8 +609,13 @@ ext2_vnop_reclaim (struct vnop_reclaim_args *args)
     {
       if (fsnode->file)
 	{
+	  int ret;
 	  log_debug ("close: freeing ext2_file_t: %p", fsnode->file);
-	  ext2fs_file_close (fsnode->file);
+	  /* Nothing can keep the file now; at least say what was lost */
+	  ret = ext2fs_file_close (fsnode->file);
+	  if (ret)
+	    log ("reclaim: ino %u: unwritten data lost (errno %d)",
+		 fsnode->ino, ret);
 	  fsnode->file = NULL;
 	}
       vnode_clearfsnode (vp);
@@ -470,6 +636,7 @@ static struct vnodeopv_entry_desc ext2_vnopv_entry_desc_list[] =
     {&vnop_close_desc, (int (*) (void *)) ext2_vnop_close},
     {&vnop_getattr_desc, (int (*) (void *)) ext2_vnop_getattr},
     {&vnop_readdir_desc, (int (*) (void *)) ext2_vnop_readdir},
+    {&vnop_write_desc, (int (*) (void *)) ext2_vnop_write},
     {&vnop_reclaim_desc, (int (*) (void *)) ext2_vnop_reclaim},
     {NULL, NULL}
   };
@@ -24,6 +24,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 #undef DEBUG
 
@@ -48,7 +49,7 @@ void ext2fs_clear_block_uninit(ext2_filsys fs, dgrp_t group)
 	ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
 	ext2fs_group_desc_csum_set(fs, group);
 	ext2fs_mark_super_dirty(fs);
-	ext2fs_mark_bb_dirty(fs);
+	ext2fs_mark_bb_group_dirty(fs, group);
 }
 
 /*
@@ -72,18 +73,98 @@ static void check_inode_uninit(ext2_filsys fs, ext2fs_inode_bitmap map,
 	/* Mimics what the kernel does */
 	ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
 	ext2fs_group_desc_csum_set(fs, group);
-	ext2fs_mark_ib_dirty(fs);
+	/* The block bitmap of the group is now on disk as well */
+	ext2fs_mark_bb_group_dirty(fs, group);
+	ext2fs_mark_ib_group_dirty(fs, group);
 	ext2fs_mark_super_dirty(fs);
 }
 
 /*
- * Right now, just search forward from the parent directory's block
- * group to find the next free inode.
+ * Orlov-style placement of a new directory.  Top-level directories are
+ * spread over the groups which have at least the average number of
+ * free inodes and free blocks, taking the one with the fewest
+ * directories.  Other directories stay close to their parent: the
+ * first group from the parent's onwards that is not crowded with
+ * directories and still has a fair share of free inodes and blocks is
+ * used.
  *
- * Should have a special policy for directories.
+ * Nothing reaches this yet: the kext has no mkdir, and the only callers
+ * of ext2fs_new_inode() allocate symlinks and EA inodes.  It is here
+ * so that directory creation gets the right placement when it is added.
  */
-errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
-			   int mode EXT2FS_ATTR((unused)),
+static dgrp_t find_group_dir(ext2_filsys fs, dgrp_t parent_group, int top)
+{
+	dgrp_t		ngroups = fs->group_desc_count;
+	dgrp_t		g, i, best = parent_group;
+	__u32		best_dirs = ~0U;
+	__u64		ndirs = 0;
+	__u64		avefreei, avefreeb, max_dirs;
+	__s64		min_inodes, min_blocks;
+
+	for (g = 0; g < ngroups; g++)
+		ndirs += ext2fs_bg_used_dirs_count(fs, g);
+	avefreei = fs->super->s_free_inodes_count / ngroups;
+	avefreeb = ext2fs_free_blocks_count(fs->super) / ngroups;
+
+	if (top) {
+		/* Rotate the starting point as inodes get used */
+		g = (fs->super->s_inodes_count -
+		     fs->super->s_free_inodes_count) % ngroups;
+		for (i = 0; i < ngroups; i++, g = (g + 1) % ngroups) {
+			if (ext2fs_bg_free_inodes_count(fs, g) == 0 ||
+			    ext2fs_bg_free_inodes_count(fs, g) < avefreei ||
+			    ext2fs_bg_free_blocks_count(fs, g) < avefreeb)
+				continue;
+			if (ext2fs_bg_used_dirs_count(fs, g) < best_dirs) {
+				best = g;
+				best_dirs = ext2fs_bg_used_dirs_count(fs, g);
+			}
+		}
+		return best;
+	}
+
+	max_dirs = ndirs / ngroups + EXT2_INODES_PER_GROUP(fs->super) / 16;
+	min_inodes = (__s64) avefreei - EXT2_INODES_PER_GROUP(fs->super) / 4;
+	if (min_inodes < 1)
+		min_inodes = 1;
+	min_blocks = (__s64) avefreeb - EXT2_BLOCKS_PER_GROUP(fs->super) / 4;
+	if (min_blocks < 0)
+		min_blocks = 0;
+
+	for (i = 0, g = parent_group; i < ngroups; i++, g = (g + 1) % ngroups) {
+		if (ext2fs_bg_used_dirs_count(fs, g) >= max_dirs ||
+		    ext2fs_bg_free_inodes_count(fs, g) < min_inodes ||
+		    ext2fs_bg_free_blocks_count(fs, g) < min_blocks)
+			continue;
+		return g;
+	}
+	return parent_group;
+}
+
+/*
+ * Place anything other than a directory in its parent's group, so that
+ * lookups and readdir stay local, unless that group has no free inodes
+ * or no free blocks left for the file's data; then take the next group
+ * which has both.
+ */
+static dgrp_t find_group_other(ext2_filsys fs, dgrp_t parent_group)
+{
+	dgrp_t		ngroups = fs->group_desc_count;
+	dgrp_t		g, i;
+
+	for (i = 0, g = parent_group; i < ngroups; i++, g = (g + 1) % ngroups) {
+		if (ext2fs_bg_free_inodes_count(fs, g) &&
+		    ext2fs_bg_free_blocks_count(fs, g))
+			return g;
+	}
+	return parent_group;
+}
+
+/*
+ * Pick a block group with find_group_dir() or find_group_other(), then
+ * search forward from it for the next free inode.
+ */
+errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir, int mode,
 			   ext2fs_inode_bitmap map, ext2_ino_t *ret)
 {
 	ext2_ino_t	start_inode = 0;
@@ -100,6 +181,13 @@ errcode_t ext2fs_new_inode(ext2_filsys fs, ext2_ino_t dir,
 
 	if (dir > 0) {
 		group = (dir - 1) / EXT2_INODES_PER_GROUP(fs->super);
+		if (group >= fs->group_desc_count)
+			group = 0;
+		if (LINUX_S_ISDIR(mode))
+			group = find_group_dir(fs, group,
+					       dir == EXT2_ROOT_INO);
+		else
+			group = find_group_other(fs, group);
 		start_inode = (group * EXT2_INODES_PER_GROUP(fs->super)) + 1;
 	}
 	if (start_inode < EXT2_FIRST_INODE(fs->super))
@@ -182,6 +270,14 @@ errcode_t ext2fs_new_block3(ext2_filsys fs, blk64_t goal,
 		goal = fs->super->s_first_data_block;
 	goal &= ~EXT2FS_CLUSTER_MASK(fs);
 
+	if (map == fs->block_map) {
+		blk64_t len;
+
+		retval = ext2fs_group_summary_search(fs, 0, goal, 1, &b, &len);
+		if (retval == 0)
+			goto allocated;
+	}
+
 	retval = ext2fs_find_first_zero_block_bitmap2(map,
 			goal, ext2fs_blocks_count(fs->super) - 1, &b);
 	if ((retval == ENOENT) && (goal != fs->super->s_first_data_block))
@@ -439,6 +535,17 @@ errcode_t ext2fs_new_range(ext2_filsys fs, int flags, blk64_t goal,
 	if (!goal || goal >= ext2fs_blocks_count(fs->super))
 		goal = fs->super->s_first_data_block;
 
+	if (map == fs->block_map && !(flags & EXT2_NEWRANGE_FIXED_GOAL) &&
+	    (ext2fs_free_extents_search(fs, flags, goal, len,
+					&start, &b) == 0 ||
+	     ext2fs_group_summary_search(fs, flags, goal, len,
+					 &start, &b) == 0)) {
+		end = start + b;
+		*pblk = start;
+		*plen = b;
+		goto allocated;
+	}
+
 	start = goal;
 	while (!looped || start <= goal) {
 		retval = ext2fs_find_first_zero_block_bitmap2(map, start,
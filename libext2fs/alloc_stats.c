@@ -13,6 +13,7 @@
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
+#include "ext2fsP.h"
 
 void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir)
@@ -49,7 +50,7 @@ void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 
 	fs->super->s_free_inodes_count -= inuse;
 	ext2fs_mark_super_dirty(fs);
-	ext2fs_mark_ib_dirty(fs);
+	ext2fs_mark_ib_group_dirty(fs, group);
 }
 
 void ext2fs_inode_alloc_stats(ext2_filsys fs, ext2_ino_t ino, int inuse)
@@ -73,6 +74,8 @@ void ext2fs_block_alloc_stats2(ext2_filsys fs, blk64_t blk, int inuse)
 		ext2fs_mark_block_bitmap2(fs->block_map, blk);
 	else
 		ext2fs_unmark_block_bitmap2(fs->block_map, blk);
+	ext2fs_free_extents_update(fs, blk, 1, inuse);
+	ext2fs_group_summary_update(fs, blk, 1, inuse);
 	ext2fs_bg_free_blocks_count_set(fs, group, ext2fs_bg_free_blocks_count(fs, group) - inuse);
 	ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
 	ext2fs_group_desc_csum_set(fs, group);
@@ -80,7 +83,7 @@ void ext2fs_block_alloc_stats2(ext2_filsys fs, blk64_t blk, int inuse)
 	ext2fs_free_blocks_count_add(fs->super,
 			     -inuse * (blk64_t) EXT2FS_CLUSTER_RATIO(fs));
 	ext2fs_mark_super_dirty(fs);
-	ext2fs_mark_bb_dirty(fs);
+	ext2fs_mark_bb_group_dirty(fs, group);
 	if (fs->block_alloc_stats)
 		(fs->block_alloc_stats)(fs, (blk64_t) blk, inuse);
 }
@@ -126,6 +129,8 @@ void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk64_t blk,
 		ext2fs_unmark_block_bitmap_range2(fs->block_map, blk, num);
 		inuse = -1;
 	}
+	ext2fs_free_extents_update(fs, blk, num, inuse);
+	ext2fs_group_summary_update(fs, blk, num, inuse);
 	while (num) {
 		int group = ext2fs_group_of_blk2(fs, blk);
 		blk64_t last_blk = ext2fs_group_last_block2(fs, group);
@@ -139,12 +144,12 @@ void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk64_t blk,
 			inuse*n/EXT2FS_CLUSTER_RATIO(fs));
 		ext2fs_bg_flags_clear(fs, group, EXT2_BG_BLOCK_UNINIT);
 		ext2fs_group_desc_csum_set(fs, group);
+		ext2fs_mark_bb_group_dirty(fs, group);
 		ext2fs_free_blocks_count_add(fs->super, -inuse * (blk64_t) n);
 		blk += n;
 		num -= n;
 	}
 	ext2fs_mark_super_dirty(fs);
-	ext2fs_mark_bb_dirty(fs);
 	if (fs->block_alloc_stats_range)
 		(fs->block_alloc_stats_range)(fs, blk, num, inuse);
 }
@@ -167,6 +167,14 @@ extern errcode_t ext2fs_find_first_set_inode_bitmap2(ext2fs_inode_bitmap bitmap,
 						      ext2_ino_t start,
 						      ext2_ino_t end,
 						      ext2_ino_t *out);
+extern errcode_t ext2fs_find_last_set_block_bitmap2(ext2fs_block_bitmap bitmap,
+						    blk64_t start,
+						    blk64_t end,
+						    blk64_t *out);
+extern errcode_t ext2fs_find_last_set_inode_bitmap2(ext2fs_inode_bitmap bitmap,
+						    ext2_ino_t start,
+						    ext2_ino_t end,
+						    ext2_ino_t *out);
 extern blk64_t ext2fs_get_block_bitmap_start2(ext2fs_block_bitmap bitmap);
 extern ext2_ino_t ext2fs_get_inode_bitmap_start2(ext2fs_inode_bitmap bitmap);
 extern blk64_t ext2fs_get_block_bitmap_end2(ext2fs_block_bitmap bitmap);
@@ -211,6 +219,9 @@ extern errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitma
 extern errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
 						    __u64 start, __u64 end,
 						    __u64 *out);
+extern errcode_t ext2fs_find_last_set_generic_bmap(ext2fs_generic_bitmap bitmap,
+						   __u64 start, __u64 end,
+						   __u64 *out);
 
 /*
  * The inline routines themselves...
@@ -537,6 +548,36 @@ _INLINE_ errcode_t ext2fs_find_first_set_inode_bitmap2(ext2fs_inode_bitmap bitma
 	return rv;
 }
 
+_INLINE_ errcode_t ext2fs_find_last_set_block_bitmap2(ext2fs_block_bitmap bitmap,
+						      blk64_t start,
+						      blk64_t end,
+						      blk64_t *out)
+{
+	__u64 o;
+	errcode_t rv;
+
+	rv = ext2fs_find_last_set_generic_bmap((ext2fs_generic_bitmap) bitmap,
+					       start, end, &o);
+	if (!rv)
+		*out = o;
+	return rv;
+}
+
+_INLINE_ errcode_t ext2fs_find_last_set_inode_bitmap2(ext2fs_inode_bitmap bitmap,
+						      ext2_ino_t start,
+						      ext2_ino_t end,
+						      ext2_ino_t *out)
+{
+	__u64 o;
+	errcode_t rv;
+
+	rv = ext2fs_find_last_set_generic_bmap((ext2fs_generic_bitmap) bitmap,
+					       start, end, &o);
+	if (!rv)
+		*out = (ext2_ino_t) o;
+	return rv;
+}
+
 _INLINE_ blk64_t ext2fs_get_block_bitmap_start2(ext2fs_block_bitmap bitmap)
 {
 	return ext2fs_get_generic_bmap_start((ext2fs_generic_bitmap) bitmap);
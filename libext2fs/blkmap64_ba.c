@@ -322,147 +322,176 @@ static void ba_print_stats(ext2fs_generic_bitmap_64 bitmap EXT2FS_ATTR((unused))
 }
 #endif
 
-/* Find the first zero bit between start and end, inclusive. */
-static errcode_t ba_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
-				    __u64 start, __u64 end, __u64 *out)
+/*
+ * Load nbytes (at most 8) bytes of the bit array as a little-endian
+ * word, so that bit n of the word is bit n of the bitmap.
+ */
+static inline __u64 ba_load_word(const unsigned char *p,
+				 unsigned int nbytes)
 {
-	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
-	unsigned long bitpos = start - bitmap->start;
-	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
+	__u64	w = 0;
 
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
-		count--;
+	if (nbytes == 8) {
+		memcpy(&w, p, 8);
+		return ext2fs_le64_to_cpu(w);
 	}
+	while (nbytes--)
+		w |= (__u64) p[nbytes] << (8 * nbytes);
+	return w;
+}
 
-	if (!count)
-		return ENOENT;
+static inline unsigned int ba_ctz64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(w);
+#else
+	unsigned int n = 0;
 
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((uintptr_t)pos) & 0x07)) {
-		if (*pos != 0xff) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
 	}
+	return n;
+#endif
+}
 
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != ((__u64)-1))
-				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0xff) {
-				break;
-			}
-			pos++;
-			i--;
-		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
-	}
+static inline unsigned int ba_clz64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_clzll(w);
+#else
+	unsigned int n = 0;
 
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (!ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
-			return 0;
-		}
-		bitpos++;
+	while (!(w >> 63)) {
+		w <<= 1;
+		n++;
 	}
-
-	return ENOENT;
+	return n;
+#endif
 }
 
-/* Find the first one bit between start and end, inclusive. */
-static errcode_t ba_find_first_set(ext2fs_generic_bitmap_64 bitmap,
-				    __u64 start, __u64 end, __u64 *out)
+/*
+ * Find the first bit equal to want in count bits starting at bitpos.
+ * The array is read a 64-bit word at a time, four words per step in
+ * the bulk of the scan, and the bit is located inside its word with a
+ * count-trailing-zeros rather than by testing each bit in turn.
+ */
+static errcode_t ba_find_first(ext2fs_generic_bitmap_64 bitmap,
+			       __u64 start, __u64 end, int want, __u64 *out)
 {
 	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
+	const unsigned char *base = (const unsigned char *) bp->bitarray;
+	const unsigned char *pos;
 	unsigned long bitpos = start - bitmap->start;
 	unsigned long count = end - start + 1;
-	int byte_found = 0; /* whether a != 0xff byte has been found */
-	const unsigned char *pos;
-	unsigned long max_loop_count, i;
+	unsigned long nbits;
+	unsigned int shift, nbytes;
+	__u64	flip = want ? 0 : ~((__u64) 0);
+	__u64	w;
+
+	while (count) {
+		pos = base + (bitpos >> 3);
+		shift = bitpos & 7;
+
+		/* Skip 256 bits at a time while nothing matches */
+		if (!shift && count >= 256) {
+			w = (ba_load_word(pos, 8) ^ flip) |
+				(ba_load_word(pos + 8, 8) ^ flip) |
+				(ba_load_word(pos + 16, 8) ^ flip) |
+				(ba_load_word(pos + 24, 8) ^ flip);
+			if (!w) {
+				bitpos += 256;
+				count -= 256;
+				continue;
+			}
+		}
 
-	/* scan bits until we hit a byte boundary */
-	while ((bitpos & 0x7) != 0 && count > 0) {
-		if (ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
+		nbytes = (shift + count + 7) >> 3;
+		if (nbytes > 8)
+			nbytes = 8;
+		nbits = nbytes * 8 - shift;
+		if (nbits > count)
+			nbits = count;
+
+		w = (ba_load_word(pos, nbytes) ^ flip) >> shift;
+		if (nbits < 64)
+			w &= ((__u64) 1 << nbits) - 1;
+		if (w) {
+			*out = bitpos + ba_ctz64(w) + bitmap->start;
 			return 0;
 		}
-		bitpos++;
-		count--;
+		bitpos += nbits;
+		count -= nbits;
 	}
 
-	if (!count)
-		return ENOENT;
+	return ENOENT;
+}
 
-	pos = ((unsigned char *)bp->bitarray) + (bitpos >> 3);
-	/* scan bytes until 8-byte (64-bit) aligned */
-	while (count >= 8 && (((uintptr_t)pos) & 0x07)) {
-		if (*pos != 0) {
-			byte_found = 1;
-			break;
-		}
-		pos++;
-		count -= 8;
-		bitpos += 8;
-	}
+/* Find the first zero bit between start and end, inclusive. */
+static errcode_t ba_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	return ba_find_first(bitmap, start, end, 0, out);
+}
 
-	if (!byte_found) {
-		max_loop_count = count >> 6; /* 8-byte blocks */
-		i = max_loop_count;
-		while (i) {
-			if (*((const __u64 *)pos) != 0)
-				break;
-			pos += 8;
-			i--;
-		}
-		count -= 64 * (max_loop_count - i);
-		bitpos += 64 * (max_loop_count - i);
-
-		max_loop_count = count >> 3;
-		i = max_loop_count;
-		while (i) {
-			if (*pos != 0) {
-				break;
+/* Find the first one bit between start and end, inclusive. */
+static errcode_t ba_find_first_set(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, __u64 end, __u64 *out)
+{
+	return ba_find_first(bitmap, start, end, 1, out);
+}
+
+/*
+ * Find the last one bit between start and end, inclusive.  This is
+ * ba_find_first() run backwards: up to eight bytes ending at the
+ * current bit are loaded as a word and the highest set bit is found
+ * with a count-leading-zeros.
+ */
+static errcode_t ba_find_last_set(ext2fs_generic_bitmap_64 bitmap,
+				  __u64 start, __u64 end, __u64 *out)
+{
+	ext2fs_ba_private bp = (ext2fs_ba_private)bitmap->private;
+	const unsigned char *base = (const unsigned char *) bp->bitarray;
+	unsigned long first = start - bitmap->start;
+	unsigned long bitpos = end - bitmap->start;
+	unsigned long count = end - start + 1;
+	unsigned long lo, hi, nbits;
+	unsigned int top;
+	__u64	w;
+
+	while (count) {
+		/* Skip 256 bits at a time while nothing is set */
+		if ((bitpos & 7) == 7 && count >= 256) {
+			const unsigned char *pos = base + ((bitpos + 1) >> 3) - 32;
+
+			w = ba_load_word(pos, 8) | ba_load_word(pos + 8, 8) |
+				ba_load_word(pos + 16, 8) |
+				ba_load_word(pos + 24, 8);
+			if (!w) {
+				bitpos -= 256;
+				count -= 256;
+				continue;
 			}
-			pos++;
-			i--;
 		}
-		count -= 8 * (max_loop_count - i);
-		bitpos += 8 * (max_loop_count - i);
-	}
 
-	/* Here either count < 8 or byte_found == 1. */
-	while (count-- > 0) {
-		if (ext2fs_test_bit64(bitpos, bp->bitarray)) {
-			*out = bitpos + bitmap->start;
+		hi = bitpos >> 3;
+		lo = (hi >= 7) ? hi - 7 : 0;
+		top = bitpos - lo * 8;
+
+		w = ba_load_word(base + lo, hi - lo + 1);
+		if (top < 63)
+			w &= ((__u64) 2 << top) - 1;
+		nbits = top + 1;
+		if (nbits > count) {
+			w &= ~((__u64) 0) << (first - lo * 8);
+			nbits = count;
+		}
+		if (w) {
+			*out = lo * 8 + 63 - ba_clz64(w) + bitmap->start;
 			return 0;
 		}
-		bitpos++;
+		bitpos -= nbits;
+		count -= nbits;
 	}
 
 	return ENOENT;
@@ -485,5 +514,6 @@ struct ext2_bitmap_ops ext2fs_blkmap64_bitarray = {
 	.clear_bmap = ba_clear_bmap,
 	.print_stats = ba_print_stats,
 	.find_first_zero = ba_find_first_zero,
-	.find_first_set = ba_find_first_set
+	.find_first_set = ba_find_first_set,
+	.find_last_set = ba_find_last_set
 };
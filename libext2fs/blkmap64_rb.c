@@ -37,11 +37,29 @@ struct bmap_rb_extent {
 	__u64 count;
 };
 
+/*
+ * Extents are carved out of slabs owned by the bitmap rather than
+ * allocated one by one, since every split and merge would otherwise
+ * go through the allocator.  Freed extents are chained through
+ * node.rb_right on free_list and handed out again before the current
+ * slab is used further; the slabs themselves are only released along
+ * with the whole tree.
+ */
+#define RB_EXTENT_SLAB	102
+
+struct bmap_rb_slab {
+	struct bmap_rb_slab *next;
+	struct bmap_rb_extent extents[RB_EXTENT_SLAB];
+};
+
 struct ext2fs_rb_private {
 	struct rb_root root;
 	struct bmap_rb_extent *wcursor;
 	struct bmap_rb_extent *rcursor;
 	struct bmap_rb_extent *rcursor_next;
+	struct bmap_rb_slab *slabs;
+	struct bmap_rb_extent *free_list;
+	unsigned int slab_used;
 #ifdef ENABLE_BMAP_STATS_OPS
 	__u64 mark_hit;
 	__u64 test_hit;
@@ -61,7 +79,8 @@ inline static struct bmap_rb_extent *node_to_extent(struct rb_node *node)
 
 static int rb_insert_extent(__u64 start, __u64 count,
 			    struct ext2fs_rb_private *);
-static void rb_get_new_extent(struct bmap_rb_extent **, __u64, __u64);
+static void rb_get_new_extent(struct ext2fs_rb_private *,
+			      struct bmap_rb_extent **, __u64, __u64);
 
 /* #define DEBUG_RB */
 
@@ -152,14 +171,58 @@ err_out:
 #define print_tree(root) do {} while (0)
 #endif
 
-static void rb_get_new_extent(struct bmap_rb_extent **ext, __u64 start,
-			     __u64 count)
+static errcode_t rb_alloc_extent(struct ext2fs_rb_private *bp,
+				 struct bmap_rb_extent **ext)
+{
+	struct bmap_rb_slab *slab;
+	errcode_t retval;
+
+	if (bp->free_list) {
+		*ext = bp->free_list;
+		bp->free_list = (struct bmap_rb_extent *) (*ext)->node.rb_right;
+		return 0;
+	}
+	if (!bp->slabs || bp->slab_used == RB_EXTENT_SLAB) {
+		retval = ext2fs_get_mem(sizeof (struct bmap_rb_slab), &slab);
+		if (retval)
+			return retval;
+		slab->next = bp->slabs;
+		bp->slabs = slab;
+		bp->slab_used = 0;
+	}
+	*ext = &bp->slabs->extents[bp->slab_used++];
+	return 0;
+}
+
+static void rb_release_extent(struct ext2fs_rb_private *bp,
+			      struct bmap_rb_extent *ext)
+{
+	ext->node.rb_right = (struct rb_node *) bp->free_list;
+	bp->free_list = ext;
+}
+
+/* Drop every extent at once, returning the slabs to the allocator */
+static void rb_free_tree(struct ext2fs_rb_private *bp)
+{
+	struct bmap_rb_slab *slab;
+
+	while ((slab = bp->slabs) != NULL) {
+		bp->slabs = slab->next;
+		ext2fs_free_mem(&slab);
+	}
+	bp->root = RB_ROOT;
+	bp->free_list = NULL;
+	bp->slab_used = 0;
+}
+
+static void rb_get_new_extent(struct ext2fs_rb_private *bp,
+			      struct bmap_rb_extent **ext, __u64 start,
+			      __u64 count)
 {
 	struct bmap_rb_extent *new_ext;
 	int retval;
 
-	retval = ext2fs_get_mem(sizeof (struct bmap_rb_extent),
-				&new_ext);
+	retval = rb_alloc_extent(bp, &new_ext);
     kassert(!retval);
 
 	new_ext->start = start;
@@ -177,7 +240,7 @@ static void rb_free_extent(struct ext2fs_rb_private *bp,
 		bp->rcursor = NULL;
 	if (bp->rcursor_next == ext)
 		bp->rcursor_next = NULL;
-	ext2fs_free_mem(&ext);
+	rb_release_extent(bp, ext);
 }
 
 static errcode_t rb_alloc_private_data (ext2fs_generic_bitmap_64 bitmap)
@@ -193,6 +256,9 @@ static errcode_t rb_alloc_private_data (ext2fs_generic_bitmap_64 bitmap)
 	bp->rcursor = NULL;
 	bp->rcursor_next = NULL;
 	bp->wcursor = NULL;
+	bp->slabs = NULL;
+	bp->free_list = NULL;
+	bp->slab_used = 0;
 
 #ifdef ENABLE_BMAP_STATS_OPS
 	bp->test_hit = 0;
@@ -215,26 +281,13 @@ static errcode_t rb_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
 	return 0;
 }
 
-static void rb_free_tree(struct rb_root *root)
-{
-	struct bmap_rb_extent *ext;
-	struct rb_node *node, *next;
-
-	for (node = ext2fs_rb_first(root); node; node = next) {
-		next = ext2fs_rb_next(node);
-		ext = node_to_extent(node);
-		ext2fs_rb_erase(node, root);
-		ext2fs_free_mem(&ext);
-	}
-}
-
 static void rb_free_bmap(ext2fs_generic_bitmap_64 bitmap)
 {
 	struct ext2fs_rb_private *bp;
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
 
-	rb_free_tree(&bp->root);
+	rb_free_tree(bp);
 	ext2fs_free_mem(&bp);
 	bp = 0;
 }
@@ -259,8 +312,7 @@ static errcode_t rb_copy_bmap(ext2fs_generic_bitmap_64 src,
 	src_node = ext2fs_rb_first(&src_bp->root);
 	while (src_node) {
 		src_ext = node_to_extent(src_node);
-		retval = ext2fs_get_mem(sizeof (struct bmap_rb_extent),
-					&dest_ext);
+		retval = rb_alloc_extent(dest_bp, &dest_ext);
 		if (retval)
 			break;
 
@@ -284,8 +336,9 @@ static errcode_t rb_copy_bmap(ext2fs_generic_bitmap_64 src,
 	return retval;
 }
 
-static void rb_truncate(__u64 new_max, struct rb_root *root)
+static void rb_truncate(__u64 new_max, struct ext2fs_rb_private *bp)
 {
+	struct rb_root *root = &bp->root;
 	struct bmap_rb_extent *ext;
 	struct rb_node *node;
 
@@ -297,7 +350,7 @@ static void rb_truncate(__u64 new_max, struct rb_root *root)
 			break;
 		else if (ext->start > new_max) {
 			ext2fs_rb_erase(node, root);
-			ext2fs_free_mem(&ext);
+			rb_release_extent(bp, ext);
 			node = ext2fs_rb_last(root);
 			continue;
 		} else
@@ -315,7 +368,7 @@ static errcode_t rb_resize_bmap(ext2fs_generic_bitmap_64 bmap,
 	bp->wcursor = NULL;
 
 	rb_truncate(((new_end < bmap->end) ? new_end : bmap->end) - bmap->start,
-		    &bp->root);
+		    bp);
 
 	bmap->end = new_end;
 	bmap->real_end = new_real_end;
@@ -442,7 +495,7 @@ got_extent:
 		}
 	}
 
-	rb_get_new_extent(&new_ext, start, count);
+	rb_get_new_extent(bp, &new_ext, start, count);
 
 	new_node = &new_ext->node;
 	ext2fs_rb_link_node(new_node, parent, n);
@@ -813,7 +866,7 @@ static void rb_clear_bmap(ext2fs_generic_bitmap_64 bitmap)
 
 	bp = (struct ext2fs_rb_private *) bitmap->private;
 
-	rb_free_tree(&bp->root);
+	rb_free_tree(bp);
 	bp->rcursor = NULL;
 	bp->rcursor_next = NULL;
 	bp->wcursor = NULL;
@@ -904,6 +957,47 @@ static errcode_t rb_find_first_set(ext2fs_generic_bitmap_64 bitmap,
 	return ENOENT;
 }
 
+static errcode_t rb_find_last_set(ext2fs_generic_bitmap_64 bitmap,
+				  __u64 start, __u64 end, __u64 *out)
+{
+	struct rb_node *n, *best = NULL;
+	struct ext2fs_rb_private *bp;
+	struct bmap_rb_extent *ext;
+	__u64 last;
+
+	bp = (struct ext2fs_rb_private *) bitmap->private;
+	n = bp->root.rb_node;
+	start -= bitmap->start;
+	end -= bitmap->start;
+
+	if (start > end)
+		return EINVAL;
+
+	/* Find the extent holding end, or else the last one before it */
+	while (n) {
+		ext = node_to_extent(n);
+		if (end < ext->start) {
+			n = n->rb_left;
+		} else if (end < ext->start + ext->count) {
+			/* The end bit is set */
+			*out = end + bitmap->start;
+			return 0;
+		} else {
+			best = n;
+			n = n->rb_right;
+		}
+	}
+
+	if (!best)
+		return ENOENT;
+	ext = node_to_extent(best);
+	last = ext->start + ext->count - 1;
+	if (last < start)
+		return ENOENT;
+	*out = last + bitmap->start;
+	return 0;
+}
+
 #ifdef ENABLE_BMAP_STATS
 static void rb_print_stats(ext2fs_generic_bitmap_64 bitmap)
 {
@@ -990,4 +1084,5 @@ struct ext2_bitmap_ops ext2fs_blkmap64_rbtree = {
 	.print_stats = rb_print_stats,
 	.find_first_zero = rb_find_first_zero,
 	.find_first_set = rb_find_first_set,
+	.find_last_set = rb_find_last_set,
 };
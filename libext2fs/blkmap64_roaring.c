@@ -0,0 +1,1223 @@
+/*
+ * blkmap64_roaring.c --- Compressed (roaring) implementation for bitmaps
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <sys/unistd.h>
+#endif
+#include <sys/fcntl.h>
+#include <sys/time.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
+
+/*
+ * The bitmap is cut into chunks of 65536 bits, counted from
+ * bitmap->start.  A chunk with no bits set has no container at all;
+ * otherwise its bits are held in whichever of three containers is
+ * smallest for them:
+ *
+ *   array   sorted 16-bit offsets of the set bits, up to 4096 of them
+ *   bitmap  a plain 8KB bit array
+ *   run     sorted, non-adjacent [start, last] pairs of set bits
+ *
+ * Single-bit operations work on the container in place and only
+ * change its type when an array overflows or a bitmap empties out;
+ * extent and range operations pick the smallest representation
+ * afterwards.  Block bitmaps are mostly long runs of used and free
+ * blocks, so a mounted filesystem costs a few bytes per group instead
+ * of a bit per block.
+ */
+
+#define ROAR_CHUNK_BITS		16
+#define ROAR_CHUNK_SIZE		(1U << ROAR_CHUNK_BITS)
+#define ROAR_CHUNK_MASK		(ROAR_CHUNK_SIZE - 1)
+#define ROAR_WORDS		(ROAR_CHUNK_SIZE / 64)
+#define ROAR_ARRAY_MAX		4096
+#define ROAR_RUN_MAX		2048
+
+#define ROAR_ARRAY		1
+#define ROAR_BITMAP		2
+#define ROAR_RUN		3
+
+struct roar_run {
+	__u16	start;
+	__u16	last;
+};
+
+struct roar_container {
+	int		type;
+	__u32		card;	/* number of bits set */
+	__u32		n;	/* array entries or runs in use */
+	__u32		alloc;	/* array entries or runs allocated */
+	union {
+		__u16		*array;
+		__u64		*words;
+		struct roar_run	*runs;
+	} u;
+};
+
+struct ext2fs_roar_private {
+	struct roar_container	**chunks;
+	__u64			nchunks;
+};
+
+typedef struct ext2fs_roar_private *ext2fs_roar_private;
+
+static inline unsigned int roar_popcount64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(w);
+#else
+	unsigned int n = 0;
+
+	for (; w; w &= w - 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline unsigned int roar_ctz64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(w);
+#else
+	unsigned int n = 0;
+
+	while (!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static inline unsigned int roar_clz64(__u64 w)
+{
+#ifdef __GNUC__
+	return __builtin_clzll(w);
+#else
+	unsigned int n = 0;
+
+	while (!(w >> 63)) {
+		w <<= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static inline __u64 roar_nchunks(__u64 start, __u64 real_end)
+{
+	return ((real_end - start) >> ROAR_CHUNK_BITS) + 1;
+}
+
+static size_t roar_data_size(int type, __u32 count)
+{
+	switch (type) {
+	case ROAR_ARRAY:
+		return count * sizeof(__u16);
+	case ROAR_RUN:
+		return count * sizeof(struct roar_run);
+	default:
+		return ROAR_WORDS * sizeof(__u64);
+	}
+}
+
+static void roar_free_container(struct roar_container *c)
+{
+	if (!c)
+		return;
+	ext2fs_free_mem(&c->u.array);
+	ext2fs_free_mem(&c);
+}
+
+/* Make room for want array entries or runs */
+static errcode_t roar_reserve(struct roar_container *c, __u32 want)
+{
+	__u32		alloc = c->alloc ? c->alloc : 4;
+	errcode_t	retval;
+
+	if (want <= c->alloc)
+		return 0;
+	while (alloc < want)
+		alloc *= 2;
+	retval = ext2fs_resize_mem(roar_data_size(c->type, c->alloc),
+				   roar_data_size(c->type, alloc),
+				   &c->u.array);
+	if (retval)
+		return retval;
+	c->alloc = alloc;
+	return 0;
+}
+
+/* First index whose entry is >= x */
+static __u32 roar_array_lower(struct roar_container *c, __u32 x)
+{
+	__u32 lo = 0, hi = c->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->u.array[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* First run that ends at or after x */
+static __u32 roar_run_lower(struct roar_container *c, __u32 x)
+{
+	__u32 lo = 0, hi = c->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->u.runs[mid].last < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* First run that starts after x */
+static __u32 roar_run_upper(struct roar_container *c, __u32 x)
+{
+	__u32 lo = 0, hi = c->n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->u.runs[mid].start <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Set or clear bits lo..hi of a bit array, returning how many changed */
+static __u32 roar_words_fill(__u64 *words, __u32 lo, __u32 hi, int set)
+{
+	__u32	w, lw = lo >> 6, hw = hi >> 6, changed = 0;
+	__u64	mask;
+
+	for (w = lw; w <= hw; w++) {
+		mask = ~((__u64) 0);
+		if (w == lw)
+			mask &= ~((__u64) 0) << (lo & 63);
+		if (w == hw)
+			mask &= ~((__u64) 0) >> (63 - (hi & 63));
+		if (set) {
+			changed += roar_popcount64(mask & ~words[w]);
+			words[w] |= mask;
+		} else {
+			changed += roar_popcount64(mask & words[w]);
+			words[w] &= ~mask;
+		}
+	}
+	return changed;
+}
+
+static int roar_test(struct roar_container *c, __u32 x)
+{
+	__u32 i;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		i = roar_array_lower(c, x);
+		return i < c->n && c->u.array[i] == x;
+	case ROAR_BITMAP:
+		return (c->u.words[x >> 6] >> (x & 63)) & 1;
+	default:
+		i = roar_run_lower(c, x);
+		return i < c->n && c->u.runs[i].start <= x;
+	}
+}
+
+/*
+ * Find the first bit equal to want between lo and hi, inclusive, of a
+ * chunk whose container is c (NULL if the chunk is empty).
+ */
+static int roar_find(struct roar_container *c, __u32 lo, __u32 hi,
+		     int want, __u32 *out)
+{
+	__u64	flip = want ? 0 : ~((__u64) 0);
+	__u64	w;
+	__u32	i, x, lw, hw;
+
+	if (!c) {
+		if (want)
+			return 0;
+		*out = lo;
+		return 1;
+	}
+	if (!want && c->card == ROAR_CHUNK_SIZE)
+		return 0;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		i = roar_array_lower(c, lo);
+		if (want) {
+			if (i < c->n && c->u.array[i] <= hi) {
+				*out = c->u.array[i];
+				return 1;
+			}
+			return 0;
+		}
+		for (x = lo; i < c->n && c->u.array[i] == x; i++, x++)
+			;
+		break;
+	case ROAR_BITMAP:
+		lw = lo >> 6;
+		hw = hi >> 6;
+		for (i = lw; i <= hw; i++) {
+			w = c->u.words[i] ^ flip;
+			if (i == lw)
+				w &= ~((__u64) 0) << (lo & 63);
+			if (i == hw)
+				w &= ~((__u64) 0) >> (63 - (hi & 63));
+			if (w) {
+				*out = i * 64 + roar_ctz64(w);
+				return 1;
+			}
+		}
+		return 0;
+	default:
+		i = roar_run_lower(c, lo);
+		if (want) {
+			if (i < c->n && c->u.runs[i].start <= hi) {
+				x = c->u.runs[i].start;
+				*out = x > lo ? x : lo;
+				return 1;
+			}
+			return 0;
+		}
+		/* Runs never touch, so the bit after a run is clear */
+		if (i < c->n && c->u.runs[i].start <= lo)
+			x = (__u32) c->u.runs[i].last + 1;
+		else
+			x = lo;
+		break;
+	}
+	if (x > hi)
+		return 0;
+	*out = x;
+	return 1;
+}
+
+/*
+ * Find the last set bit between lo and hi, inclusive, of a chunk
+ * whose container is c (NULL if the chunk is empty).
+ */
+static int roar_find_last(struct roar_container *c, __u32 lo, __u32 hi,
+			  __u32 *out)
+{
+	__u64	w;
+	__u32	i, lw, hw;
+
+	if (!c)
+		return 0;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		i = roar_array_lower(c, hi + 1);
+		if (i && c->u.array[i - 1] >= lo) {
+			*out = c->u.array[i - 1];
+			return 1;
+		}
+		return 0;
+	case ROAR_BITMAP:
+		lw = lo >> 6;
+		hw = hi >> 6;
+		for (i = hw + 1; i-- > lw; ) {
+			w = c->u.words[i];
+			if (i == lw)
+				w &= ~((__u64) 0) << (lo & 63);
+			if (i == hw)
+				w &= ~((__u64) 0) >> (63 - (hi & 63));
+			if (w) {
+				*out = i * 64 + 63 - roar_clz64(w);
+				return 1;
+			}
+		}
+		return 0;
+	default:
+		i = roar_run_upper(c, hi);
+		if (i && c->u.runs[i - 1].last >= lo) {
+			*out = c->u.runs[i - 1].last < hi ?
+				c->u.runs[i - 1].last : hi;
+			return 1;
+		}
+		return 0;
+	}
+}
+
+/*
+ * Walk the set bits of a container as runs.  *pos is the iterator
+ * state and starts at zero; returns 0 when there are no more runs.
+ */
+static int roar_next_run(struct roar_container *c, __u32 *pos,
+			 __u32 *first, __u32 *last)
+{
+	__u32 i = *pos, x;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		if (i >= c->n)
+			return 0;
+		*first = c->u.array[i];
+		while (i + 1 < c->n && c->u.array[i + 1] == c->u.array[i] + 1)
+			i++;
+		*last = c->u.array[i];
+		*pos = i + 1;
+		return 1;
+	case ROAR_BITMAP:
+		if (i >= ROAR_CHUNK_SIZE ||
+		    !roar_find(c, i, ROAR_CHUNK_MASK, 1, first))
+			return 0;
+		if (roar_find(c, *first, ROAR_CHUNK_MASK, 0, &x))
+			*last = x - 1;
+		else
+			*last = ROAR_CHUNK_MASK;
+		*pos = *last + 1;
+		return 1;
+	default:
+		if (i >= c->n)
+			return 0;
+		*first = c->u.runs[i].start;
+		*last = c->u.runs[i].last;
+		*pos = i + 1;
+		return 1;
+	}
+}
+
+static __u32 roar_count_runs(struct roar_container *c)
+{
+	__u32	i, runs = 0;
+	__u64	w, prev = 0;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		for (i = 0; i < c->n; i++)
+			if (!i || c->u.array[i] != c->u.array[i - 1] + 1)
+				runs++;
+		return runs;
+	case ROAR_BITMAP:
+		for (i = 0; i < ROAR_WORDS; i++) {
+			w = c->u.words[i];
+			runs += roar_popcount64(w & ~((w << 1) | (prev >> 63)));
+			prev = w;
+		}
+		return runs;
+	default:
+		return c->n;
+	}
+}
+
+/* Rebuild a container as another type, keeping the same bits */
+static errcode_t roar_convert(struct roar_container *c, int type)
+{
+	struct roar_container	tmp;
+	errcode_t		retval;
+	__u32			pos = 0, first, last, x;
+
+	if (c->type == type)
+		return 0;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.type = type;
+	tmp.card = c->card;
+	switch (type) {
+	case ROAR_ARRAY:
+		tmp.alloc = c->card;
+		break;
+	case ROAR_RUN:
+		tmp.alloc = roar_count_runs(c);
+		break;
+	default:
+		tmp.alloc = ROAR_WORDS;
+	}
+	retval = ext2fs_get_memzero(roar_data_size(type, tmp.alloc),
+				    &tmp.u.array);
+	if (retval)
+		return retval;
+
+	while (roar_next_run(c, &pos, &first, &last)) {
+		switch (type) {
+		case ROAR_ARRAY:
+			for (x = first; x <= last; x++)
+				tmp.u.array[tmp.n++] = x;
+			break;
+		case ROAR_RUN:
+			tmp.u.runs[tmp.n].start = first;
+			tmp.u.runs[tmp.n].last = last;
+			tmp.n++;
+			break;
+		default:
+			roar_words_fill(tmp.u.words, first, last, 1);
+		}
+	}
+
+	ext2fs_free_mem(&c->u.array);
+	*c = tmp;
+	return 0;
+}
+
+/* Switch a container to whichever type takes the least memory */
+static errcode_t roar_optimize(struct roar_container *c)
+{
+	size_t	best_size = roar_data_size(ROAR_BITMAP, 0);
+	int	best = ROAR_BITMAP;
+	__u32	runs = roar_count_runs(c);
+
+	if (c->card <= ROAR_ARRAY_MAX &&
+	    roar_data_size(ROAR_ARRAY, c->card) < best_size) {
+		best = ROAR_ARRAY;
+		best_size = roar_data_size(ROAR_ARRAY, c->card);
+	}
+	if (roar_data_size(ROAR_RUN, runs) < best_size)
+		best = ROAR_RUN;
+	return roar_convert(c, best);
+}
+
+static errcode_t roar_array_fill_one(struct roar_container *c, __u32 x,
+				     int set)
+{
+	__u32		i = roar_array_lower(c, x);
+	int		present = i < c->n && c->u.array[i] == x;
+	errcode_t	retval;
+
+	if (set == present)
+		return 0;
+	if (!set) {
+		memmove(c->u.array + i, c->u.array + i + 1,
+			(c->n - i - 1) * sizeof(__u16));
+		c->n--;
+		c->card--;
+		return 0;
+	}
+	if (c->n >= ROAR_ARRAY_MAX) {
+		retval = roar_convert(c, ROAR_BITMAP);
+		if (retval)
+			return retval;
+		c->card += roar_words_fill(c->u.words, x, x, 1);
+		return 0;
+	}
+	retval = roar_reserve(c, c->n + 1);
+	if (retval)
+		return retval;
+	memmove(c->u.array + i + 1, c->u.array + i,
+		(c->n - i) * sizeof(__u16));
+	c->u.array[i] = x;
+	c->n++;
+	c->card++;
+	return 0;
+}
+
+static void roar_array_clear(struct roar_container *c, __u32 lo, __u32 hi)
+{
+	__u32 i = roar_array_lower(c, lo);
+	__u32 j = roar_array_lower(c, hi + 1);
+
+	memmove(c->u.array + i, c->u.array + j,
+		(c->n - j) * sizeof(__u16));
+	c->n -= j - i;
+	c->card -= j - i;
+}
+
+/* Replace runs i..j-1 with the k runs in new_runs */
+static errcode_t roar_run_splice(struct roar_container *c, __u32 i, __u32 j,
+				 struct roar_run *new_runs, __u32 k)
+{
+	errcode_t retval;
+
+	if (k > j - i) {
+		retval = roar_reserve(c, c->n + k - (j - i));
+		if (retval)
+			return retval;
+	}
+	memmove(c->u.runs + i + k, c->u.runs + j,
+		(c->n - j) * sizeof(struct roar_run));
+	memcpy(c->u.runs + i, new_runs, k * sizeof(struct roar_run));
+	c->n = c->n + k - (j - i);
+	return 0;
+}
+
+static errcode_t roar_run_fill(struct roar_container *c, __u32 lo, __u32 hi,
+			       int set)
+{
+	struct roar_run	piece[2];
+	__u32		i, j, x, k = 0, removed = 0;
+
+	if (set) {
+		/* Runs overlapping or adjacent to lo..hi merge with it */
+		i = lo ? roar_run_lower(c, lo - 1) : 0;
+		j = roar_run_upper(c, hi + 1);
+		piece[0].start = lo;
+		piece[0].last = hi;
+		if (i < j) {
+			if (c->u.runs[i].start < lo)
+				piece[0].start = c->u.runs[i].start;
+			if (c->u.runs[j - 1].last > hi)
+				piece[0].last = c->u.runs[j - 1].last;
+		}
+		for (x = i; x < j; x++)
+			removed += c->u.runs[x].last - c->u.runs[x].start + 1;
+		c->card = c->card - removed +
+			(piece[0].last - piece[0].start + 1);
+		return roar_run_splice(c, i, j, piece, 1);
+	}
+
+	i = roar_run_lower(c, lo);
+	j = roar_run_upper(c, hi);
+	if (i >= j)
+		return 0;
+	for (x = i; x < j; x++)
+		removed += c->u.runs[x].last - c->u.runs[x].start + 1;
+	if (c->u.runs[i].start < lo) {
+		piece[k].start = c->u.runs[i].start;
+		piece[k].last = lo - 1;
+		removed -= piece[k].last - piece[k].start + 1;
+		k++;
+	}
+	if (c->u.runs[j - 1].last > hi) {
+		piece[k].start = hi + 1;
+		piece[k].last = c->u.runs[j - 1].last;
+		removed -= piece[k].last - piece[k].start + 1;
+		k++;
+	}
+	c->card -= removed;
+	return roar_run_splice(c, i, j, piece, k);
+}
+
+static errcode_t roar_new_container(struct roar_container **cp, __u32 lo,
+				    __u32 hi)
+{
+	struct roar_container	*c;
+	errcode_t		retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct roar_container), &c);
+	if (retval)
+		return retval;
+	c->type = lo == hi ? ROAR_ARRAY : ROAR_RUN;
+	retval = roar_reserve(c, 1);
+	if (retval) {
+		ext2fs_free_mem(&c);
+		return retval;
+	}
+	if (lo == hi) {
+		c->u.array[0] = lo;
+	} else {
+		c->u.runs[0].start = lo;
+		c->u.runs[0].last = hi;
+	}
+	c->n = 1;
+	c->card = hi - lo + 1;
+	*cp = c;
+	return 0;
+}
+
+/*
+ * Set or clear bits lo..hi of the chunk whose container is *cp,
+ * creating the container if needed and freeing it once it is empty.
+ */
+static errcode_t roar_fill(struct roar_container **cp, __u32 lo, __u32 hi,
+			   int set)
+{
+	struct roar_container	*c = *cp;
+	errcode_t		retval = 0;
+	__u32			changed;
+
+	if (!c)
+		return set ? roar_new_container(cp, lo, hi) : 0;
+
+	switch (c->type) {
+	case ROAR_ARRAY:
+		if (lo == hi) {
+			retval = roar_array_fill_one(c, lo, set);
+			break;
+		}
+		if (!set) {
+			roar_array_clear(c, lo, hi);
+			break;
+		}
+		retval = roar_convert(c, ROAR_BITMAP);
+		if (retval)
+			return retval;
+		/* fall through */
+	case ROAR_BITMAP:
+		changed = roar_words_fill(c->u.words, lo, hi, set);
+		c->card = set ? c->card + changed : c->card - changed;
+		/*
+		 * Only look for a smaller container after single-bit
+		 * clears once the bitmap is well below the array limit,
+		 * so that a chunk hovering around it does not flip
+		 * back and forth.
+		 */
+		if (c->card && (lo != hi || c->card == ROAR_CHUNK_SIZE))
+			retval = roar_optimize(c);
+		else if (c->card && c->card <= ROAR_ARRAY_MAX / 2)
+			retval = roar_convert(c, ROAR_ARRAY);
+		break;
+	default:
+		retval = roar_run_fill(c, lo, hi, set);
+		if (!retval && c->n > ROAR_RUN_MAX)
+			retval = roar_optimize(c);
+		break;
+	}
+
+	if (!c->card) {
+		roar_free_container(c);
+		*cp = NULL;
+	}
+	return retval;
+}
+
+/* Set or clear bits first..last, relative to bitmap->start */
+static errcode_t roar_fill_bits(ext2fs_roar_private bp, __u64 first,
+				__u64 last, int set)
+{
+	__u64		chunk, end;
+	errcode_t	retval;
+
+	while (first <= last) {
+		chunk = first >> ROAR_CHUNK_BITS;
+		end = (chunk << ROAR_CHUNK_BITS) | ROAR_CHUNK_MASK;
+		if (end > last)
+			end = last;
+		retval = roar_fill(&bp->chunks[chunk], first & ROAR_CHUNK_MASK,
+				   end & ROAR_CHUNK_MASK, set);
+		if (retval)
+			return retval;
+		first = end + 1;
+	}
+	return 0;
+}
+
+static void roar_free_chunks(ext2fs_roar_private bp, __u64 from)
+{
+	__u64 i;
+
+	for (i = from; i < bp->nchunks; i++) {
+		roar_free_container(bp->chunks[i]);
+		bp->chunks[i] = NULL;
+	}
+}
+
+static errcode_t roar_alloc_private_data(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_roar_private	bp;
+	errcode_t		retval;
+
+	retval = ext2fs_get_mem(sizeof(struct ext2fs_roar_private), &bp);
+	if (retval)
+		return retval;
+
+	bp->nchunks = roar_nchunks(bitmap->start, bitmap->real_end);
+	retval = ext2fs_get_arrayzero(bp->nchunks,
+				      sizeof(struct roar_container *),
+				      &bp->chunks);
+	if (retval) {
+		ext2fs_free_mem(&bp);
+		return retval;
+	}
+	bitmap->private = (void *) bp;
+	return 0;
+}
+
+static errcode_t roar_new_bmap(ext2_filsys fs EXT2FS_ATTR((unused)),
+			       ext2fs_generic_bitmap_64 bitmap)
+{
+	return roar_alloc_private_data(bitmap);
+}
+
+static void roar_free_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_roar_private bp = (ext2fs_roar_private) bitmap->private;
+
+	if (!bp)
+		return;
+
+	roar_free_chunks(bp, 0);
+	ext2fs_free_mem(&bp->chunks);
+	ext2fs_free_mem(&bp);
+	bitmap->private = NULL;
+}
+
+static errcode_t roar_copy_bmap(ext2fs_generic_bitmap_64 src,
+				ext2fs_generic_bitmap_64 dest)
+{
+	ext2fs_roar_private	src_bp = (ext2fs_roar_private) src->private;
+	ext2fs_roar_private	dest_bp;
+	struct roar_container	*c, *sc;
+	errcode_t		retval;
+	size_t			size;
+	__u64			i;
+
+	retval = roar_alloc_private_data(dest);
+	if (retval)
+		return retval;
+	dest_bp = (ext2fs_roar_private) dest->private;
+
+	for (i = 0; i < src_bp->nchunks; i++) {
+		sc = src_bp->chunks[i];
+		if (!sc)
+			continue;
+		retval = ext2fs_get_mem(sizeof(struct roar_container), &c);
+		if (retval)
+			goto errout;
+		*c = *sc;
+		if (c->type != ROAR_BITMAP)
+			c->alloc = c->n;
+		size = roar_data_size(c->type, c->alloc);
+		retval = ext2fs_get_mem(size, &c->u.array);
+		if (retval) {
+			ext2fs_free_mem(&c);
+			goto errout;
+		}
+		memcpy(c->u.array, sc->u.array, size);
+		dest_bp->chunks[i] = c;
+	}
+	return 0;
+
+errout:
+	roar_free_bmap(dest);
+	return retval;
+}
+
+static errcode_t roar_resize_bmap(ext2fs_generic_bitmap_64 bmap,
+				  __u64 new_end, __u64 new_real_end)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bmap->private;
+	errcode_t		retval;
+	__u64			last, nchunks;
+
+	/*
+	 * If we're expanding the bitmap, make sure all of the new
+	 * parts of the bitmap are zero.
+	 */
+	if (new_end > bmap->end) {
+		last = bmap->real_end;
+		if (last > new_end)
+			last = new_end;
+		if (last > bmap->end) {
+			retval = roar_fill_bits(bp, bmap->end + 1 - bmap->start,
+						last - bmap->start, 0);
+			if (retval)
+				return retval;
+		}
+	}
+	if (new_real_end == bmap->real_end) {
+		bmap->end = new_end;
+		return 0;
+	}
+
+	if (new_real_end < bmap->real_end) {
+		retval = roar_fill_bits(bp, new_real_end + 1 - bmap->start,
+					bmap->real_end - bmap->start, 0);
+		if (retval)
+			return retval;
+	}
+
+	nchunks = roar_nchunks(bmap->start, new_real_end);
+	if (nchunks != bp->nchunks) {
+		if (nchunks < bp->nchunks)
+			roar_free_chunks(bp, nchunks);
+		retval = ext2fs_resize_mem(bp->nchunks *
+					   sizeof(struct roar_container *),
+					   nchunks *
+					   sizeof(struct roar_container *),
+					   &bp->chunks);
+		if (retval)
+			return retval;
+		if (nchunks > bp->nchunks)
+			memset(bp->chunks + bp->nchunks, 0,
+			       (nchunks - bp->nchunks) *
+			       sizeof(struct roar_container *));
+		bp->nchunks = nchunks;
+	}
+
+	bmap->end = new_end;
+	bmap->real_end = new_real_end;
+	return 0;
+}
+
+static int roar_mark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	__u64			bitno = arg - bitmap->start;
+	struct roar_container	**cp = &bp->chunks[bitno >> ROAR_CHUNK_BITS];
+	__u32			x = bitno & ROAR_CHUNK_MASK;
+	errcode_t		retval;
+
+	if (*cp && roar_test(*cp, x))
+		return 1;
+	retval = roar_fill(cp, x, x, 1);
+	kassert(!retval);
+	return 0;
+}
+
+static int roar_unmark_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	__u64			bitno = arg - bitmap->start;
+	struct roar_container	**cp = &bp->chunks[bitno >> ROAR_CHUNK_BITS];
+	__u32			x = bitno & ROAR_CHUNK_MASK;
+	errcode_t		retval;
+
+	if (!*cp || !roar_test(*cp, x))
+		return 0;
+	retval = roar_fill(cp, x, x, 0);
+	kassert(!retval);
+	return 1;
+}
+
+static int roar_test_bmap(ext2fs_generic_bitmap_64 bitmap, __u64 arg)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	__u64			bitno = arg - bitmap->start;
+	struct roar_container	*c = bp->chunks[bitno >> ROAR_CHUNK_BITS];
+
+	return c && roar_test(c, bitno & ROAR_CHUNK_MASK);
+}
+
+static void roar_mark_bmap_extent(ext2fs_generic_bitmap_64 bitmap, __u64 arg,
+				  unsigned int num)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	errcode_t		retval;
+
+	if (!num)
+		return;
+	retval = roar_fill_bits(bp, arg - bitmap->start,
+				arg - bitmap->start + num - 1, 1);
+	kassert(!retval);
+}
+
+static void roar_unmark_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				    __u64 arg, unsigned int num)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	errcode_t		retval;
+
+	if (!num)
+		return;
+	retval = roar_fill_bits(bp, arg - bitmap->start,
+				arg - bitmap->start + num - 1, 0);
+	kassert(!retval);
+}
+
+static errcode_t roar_find_first(ext2fs_generic_bitmap_64 bitmap,
+				 __u64 start, __u64 end, int want, __u64 *out)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	__u64			first = start - bitmap->start;
+	__u64			last = end - bitmap->start;
+	__u64			chunk, cend;
+	__u32			x;
+
+	while (first <= last) {
+		chunk = first >> ROAR_CHUNK_BITS;
+		cend = (chunk << ROAR_CHUNK_BITS) | ROAR_CHUNK_MASK;
+		if (cend > last)
+			cend = last;
+		if (roar_find(bp->chunks[chunk], first & ROAR_CHUNK_MASK,
+			      cend & ROAR_CHUNK_MASK, want, &x)) {
+			*out = (chunk << ROAR_CHUNK_BITS) + x + bitmap->start;
+			return 0;
+		}
+		first = cend + 1;
+	}
+	return ENOENT;
+}
+
+/* Find the last one bit between start and end, inclusive. */
+static errcode_t roar_find_last_set(ext2fs_generic_bitmap_64 bitmap,
+				    __u64 start, __u64 end, __u64 *out)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	__u64			first = start - bitmap->start;
+	__u64			last = end - bitmap->start;
+	__u64			chunk, cstart;
+	__u32			x;
+
+	while (first <= last) {
+		chunk = last >> ROAR_CHUNK_BITS;
+		cstart = chunk << ROAR_CHUNK_BITS;
+		if (cstart < first)
+			cstart = first;
+		if (roar_find_last(bp->chunks[chunk], cstart & ROAR_CHUNK_MASK,
+				   last & ROAR_CHUNK_MASK, &x)) {
+			*out = (chunk << ROAR_CHUNK_BITS) + x + bitmap->start;
+			return 0;
+		}
+		if (!cstart)
+			break;
+		last = cstart - 1;
+	}
+	return ENOENT;
+}
+
+static int roar_test_clear_bmap_extent(ext2fs_generic_bitmap_64 bitmap,
+				       __u64 start, unsigned int len)
+{
+	__u64 found;
+
+	if (!len)
+		return 1;
+	return roar_find_first(bitmap, start, start + len - 1, 1,
+			       &found) == ENOENT;
+}
+
+/*
+ * Copy len bits from in, starting at bit off, into bits lo.. of a
+ * cleared stretch of a bit array, returning how many were set.
+ */
+static __u32 roar_words_load(__u64 *words, __u32 lo, const unsigned char *in,
+			     __u64 off, __u32 len)
+{
+	__u32	i = 0, set = 0;
+	__u64	b;
+
+	if (!((lo | off) & 7)) {
+		for (; i + 8 <= len; i += 8) {
+			b = in[(off + i) >> 3];
+			words[(lo + i) >> 6] |= b << ((lo + i) & 63);
+			set += roar_popcount64(b);
+		}
+	}
+	for (; i < len; i++) {
+		if (ext2fs_test_bit64(off + i, in)) {
+			words[(lo + i) >> 6] |= (__u64) 1 << ((lo + i) & 63);
+			set++;
+		}
+	}
+	return set;
+}
+
+/* Set count bits of out starting at bit off */
+static void roar_set_bits(unsigned char *out, __u64 off, __u64 count)
+{
+	while (count && (off & 7)) {
+		ext2fs_fast_set_bit64(off++, out);
+		count--;
+	}
+	if (count >= 8) {
+		memset(out + (off >> 3), 0xff, count >> 3);
+		off += count & ~7ULL;
+		count &= 7;
+	}
+	while (count--)
+		ext2fs_fast_set_bit64(off++, out);
+}
+
+static errcode_t roar_set_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, size_t num, void *in)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	struct roar_container	**cp, *c;
+	errcode_t		retval;
+	__u64			first = start - bitmap->start;
+	__u64			last = first + num - 1;
+	__u64			chunk, end;
+	__u32			lo, hi;
+
+	/*
+	 * Each chunk touched is widened to a bitmap, has the new bits
+	 * copied in, and is then shrunk to its best container.
+	 */
+	while (num && first <= last) {
+		chunk = first >> ROAR_CHUNK_BITS;
+		end = (chunk << ROAR_CHUNK_BITS) | ROAR_CHUNK_MASK;
+		if (end > last)
+			end = last;
+		lo = first & ROAR_CHUNK_MASK;
+		hi = end & ROAR_CHUNK_MASK;
+		cp = &bp->chunks[chunk];
+
+		if (!*cp) {
+			retval = ext2fs_get_memzero(sizeof(struct roar_container),
+						    cp);
+			if (retval)
+				return retval;
+			(*cp)->type = ROAR_BITMAP;
+			(*cp)->alloc = ROAR_WORDS;
+			retval = ext2fs_get_memzero(roar_data_size(ROAR_BITMAP, 0),
+						    &(*cp)->u.words);
+			if (retval) {
+				ext2fs_free_mem(cp);
+				return retval;
+			}
+		}
+		c = *cp;
+		retval = roar_convert(c, ROAR_BITMAP);
+		if (!retval) {
+			c->card -= roar_words_fill(c->u.words, lo, hi, 0);
+			c->card += roar_words_load(c->u.words, lo, in,
+						   first + bitmap->start - start,
+						   hi - lo + 1);
+			if (c->card)
+				retval = roar_optimize(c);
+		}
+		if (!c->card) {
+			roar_free_container(c);
+			*cp = NULL;
+		}
+		if (retval)
+			return retval;
+		first = end + 1;
+	}
+	return 0;
+}
+
+static errcode_t roar_get_bmap_range(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, size_t num, void *out)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	struct roar_container	*c;
+	unsigned char		*cp = out;
+	__u64			first = start - bitmap->start;
+	__u64			last = first + num - 1;
+	__u64			chunk, end, off, b;
+	__u32			lo, hi, pos, rfirst, rlast, i;
+
+	memset(out, 0, (num + 7) >> 3);
+
+	while (num && first <= last) {
+		chunk = first >> ROAR_CHUNK_BITS;
+		end = (chunk << ROAR_CHUNK_BITS) | ROAR_CHUNK_MASK;
+		if (end > last)
+			end = last;
+		lo = first & ROAR_CHUNK_MASK;
+		hi = end & ROAR_CHUNK_MASK;
+		off = first + bitmap->start - start;
+		c = bp->chunks[chunk];
+		first = end + 1;
+		if (!c)
+			continue;
+
+		if (c->type == ROAR_BITMAP) {
+			i = 0;
+			if (!((lo | off) & 7)) {
+				for (; lo + i + 8 <= hi + 1; i += 8) {
+					b = c->u.words[(lo + i) >> 6];
+					cp[(off + i) >> 3] =
+						(b >> ((lo + i) & 63)) & 0xff;
+				}
+			}
+			for (; lo + i <= hi; i++)
+				if (roar_test(c, lo + i))
+					ext2fs_fast_set_bit64(off + i, cp);
+			continue;
+		}
+
+		pos = 0;
+		while (roar_next_run(c, &pos, &rfirst, &rlast)) {
+			if (rlast < lo)
+				continue;
+			if (rfirst > hi)
+				break;
+			if (rfirst < lo)
+				rfirst = lo;
+			if (rlast > hi)
+				rlast = hi;
+			roar_set_bits(cp, off + rfirst - lo, rlast - rfirst + 1);
+		}
+	}
+	return 0;
+}
+
+static void roar_clear_bmap(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_roar_private bp = (ext2fs_roar_private) bitmap->private;
+
+	roar_free_chunks(bp, 0);
+}
+
+#ifdef ENABLE_BMAP_STATS
+static void roar_print_stats(ext2fs_generic_bitmap_64 bitmap)
+{
+	ext2fs_roar_private	bp = (ext2fs_roar_private) bitmap->private;
+	struct roar_container	*c;
+	unsigned long long	count[4] = { 0 };
+	unsigned long long	size, bits = 0;
+	__u64			i;
+
+	size = sizeof(struct ext2fs_roar_private) +
+		bp->nchunks * sizeof(struct roar_container *);
+	for (i = 0; i < bp->nchunks; i++) {
+		c = bp->chunks[i];
+		if (!c) {
+			count[0]++;
+			continue;
+		}
+		count[c->type]++;
+		bits += c->card;
+		size += sizeof(struct roar_container) +
+			roar_data_size(c->type, c->alloc);
+	}
+	printf("%16llu empty chunks\n"
+	       "%16llu array containers\n"
+	       "%16llu bitmap containers\n"
+	       "%16llu run containers\n",
+	       count[0], count[ROAR_ARRAY], count[ROAR_BITMAP],
+	       count[ROAR_RUN]);
+	printf("%16llu bits set in bitmap (out of %llu)\n", bits,
+	       (unsigned long long) bitmap->real_end - bitmap->start);
+	printf("%16llu Bytes used by roaring bitmap\n", size);
+}
+#else
+static void roar_print_stats(ext2fs_generic_bitmap_64 bitmap EXT2FS_ATTR((unused)))
+{
+}
+#endif
+
+/* Find the first zero bit between start and end, inclusive. */
+static errcode_t roar_find_first_zero(ext2fs_generic_bitmap_64 bitmap,
+				      __u64 start, __u64 end, __u64 *out)
+{
+	return roar_find_first(bitmap, start, end, 0, out);
+}
+
+/* Find the first one bit between start and end, inclusive. */
+static errcode_t roar_find_first_set(ext2fs_generic_bitmap_64 bitmap,
+				     __u64 start, __u64 end, __u64 *out)
+{
+	return roar_find_first(bitmap, start, end, 1, out);
+}
+
+struct ext2_bitmap_ops ext2fs_blkmap64_roaring = {
+	.type = EXT2FS_BMAP64_ROARING,
+	.new_bmap = roar_new_bmap,
+	.free_bmap = roar_free_bmap,
+	.copy_bmap = roar_copy_bmap,
+	.resize_bmap = roar_resize_bmap,
+	.mark_bmap = roar_mark_bmap,
+	.unmark_bmap = roar_unmark_bmap,
+	.test_bmap = roar_test_bmap,
+	.test_clear_bmap_extent = roar_test_clear_bmap_extent,
+	.mark_bmap_extent = roar_mark_bmap_extent,
+	.unmark_bmap_extent = roar_unmark_bmap_extent,
+	.set_bmap_range = roar_set_bmap_range,
+	.get_bmap_range = roar_get_bmap_range,
+	.clear_bmap = roar_clear_bmap,
+	.print_stats = roar_print_stats,
+	.find_first_zero = roar_find_first_zero,
+	.find_first_set = roar_find_first_set,
+	.find_last_set = roar_find_last_set
+};
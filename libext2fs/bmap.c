@@ -480,6 +480,129 @@ done:
 	return retval;
 }
 
+static errcode_t read_ind_entry(ext2_filsys fs, blk_t ind, char *block_buf,
+				blk_t nr, blk_t *ret_blk)
+{
+	errcode_t	retval;
+
+	*ret_blk = 0;
+	if (!ind)
+		return 0;
+	retval = io_channel_read_blk(fs->io, ind, 1, block_buf);
+	if (retval)
+		return retval;
+	*ret_blk = ext2fs_le32_to_cpu(((blk_t *) block_buf)[nr]);
+	return 0;
+}
+
+/*
+ * Map up to count logical blocks starting at block with a single walk
+ * of the indirect block tree.  The walk stops at the end of the direct
+ * blocks or of the indirect block holding the mapping for block, so
+ * fewer than count blocks may be mapped; the number is returned in
+ * *ret_count.  Holes are returned as zero.  Extent-mapped files are
+ * mapped one block at a time, with unwritten blocks returned as holes.
+ */
+errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+			    struct ext2_inode *inode, char *block_buf,
+			    blk64_t block, blk64_t count,
+			    blk64_t *phys_blks, blk64_t *ret_count)
+{
+	struct ext2_inode inode_buf;
+	blk64_t		addr_per_block, start;
+	blk64_t		i, n;
+	blk_t		b;
+	char		*buf = 0;
+	int		ret_flags;
+	errcode_t	retval = 0;
+
+	*ret_count = 0;
+	if (!count)
+		return 0;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+
+	if (ext2fs_file_block_offset_too_big(fs, inode, block))
+		return EXT2_ET_FILE_TOO_BIG;
+
+	if (inode->i_flags & EXT4_INLINE_DATA_FL)
+		return EXT2_ET_INLINE_DATA_NO_BLOCK;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL) {
+		retval = ext2fs_bmap2(fs, ino, inode, block_buf, 0, block,
+				      &ret_flags, phys_blks);
+		if (retval)
+			return retval;
+		if (ret_flags & BMAP_RET_UNINIT)
+			phys_blks[0] = 0;
+		*ret_count = 1;
+		return 0;
+	}
+
+	if (block < EXT2_NDIR_BLOCKS) {
+		n = EXT2_NDIR_BLOCKS - block;
+		if (n > count)
+			n = count;
+		for (i = 0; i < n; i++)
+			phys_blks[i] = inode_bmap(inode, block + i);
+		*ret_count = n;
+		return 0;
+	}
+
+	if (!block_buf) {
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+		if (retval)
+			return retval;
+		block_buf = buf;
+	}
+
+	addr_per_block = (blk64_t) fs->blocksize >> 2;
+	start = block - EXT2_NDIR_BLOCKS;
+	if (start < addr_per_block) {
+		b = inode_bmap(inode, EXT2_IND_BLOCK);
+	} else if ((start -= addr_per_block) <
+		   addr_per_block * addr_per_block) {
+		retval = read_ind_entry(fs, inode_bmap(inode, EXT2_DIND_BLOCK),
+					block_buf, start / addr_per_block, &b);
+	} else {
+		start -= addr_per_block * addr_per_block;
+		retval = read_ind_entry(fs, inode_bmap(inode, EXT2_TIND_BLOCK),
+					block_buf,
+					start / (addr_per_block * addr_per_block),
+					&b);
+		if (retval == 0)
+			retval = read_ind_entry(fs, b, block_buf,
+						(start / addr_per_block) %
+						addr_per_block, &b);
+	}
+	if (retval)
+		goto done;
+	start %= addr_per_block;
+
+	n = addr_per_block - start;
+	if (n > count)
+		n = count;
+	if (b) {
+		retval = io_channel_read_blk(fs->io, b, 1, block_buf);
+		if (retval)
+			goto done;
+		for (i = 0; i < n; i++)
+			phys_blks[i] = ext2fs_le32_to_cpu(
+				((blk_t *) block_buf)[start + i]);
+	} else
+		memset(phys_blks, 0, n * sizeof(blk64_t));
+	*ret_count = n;
+done:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return retval;
+}
+
 errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 		      char *block_buf, int bmap_flags, blk_t block,
 		      blk_t *phys_blk)
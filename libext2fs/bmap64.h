@@ -37,6 +37,8 @@ struct ext2_bmap_statistics {
 };
 
 
+typedef struct ext2fs_struct_generic_bitmap_64 *ext2fs_generic_bitmap_64;
+
 struct ext2fs_struct_generic_bitmap_64 {
 	errcode_t		magic;
 	ext2_filsys 		fs;
@@ -48,13 +50,22 @@ struct ext2fs_struct_generic_bitmap_64 {
 	char			*description;
 	void			*private;
 	errcode_t		base_error_code;
+	/*
+	 * Bitmaps read with EXT2FS_BITMAPS_LAZY are filled in one group
+	 * (group_bits bits) at a time: load_group is called before the
+	 * bits of a group are first used, and is cleared once every group
+	 * is resident.  load_private is a single allocation owned by the
+	 * loader and freed along with the bitmap.
+	 */
+	errcode_t		(*load_group)(ext2fs_generic_bitmap_64 bmap,
+					      __u64 group);
+	__u64			group_bits;
+	void			*load_private;
 #ifdef ENABLE_BMAP_STATS
 	struct ext2_bmap_statistics	stats;
 #endif
 };
 
-typedef struct ext2fs_struct_generic_bitmap_64 *ext2fs_generic_bitmap_64;
-
 #define EXT2FS_IS_32_BITMAP(bmap) \
 	(((bmap)->magic == EXT2_ET_MAGIC_GENERIC_BITMAP) || \
 	 ((bmap)->magic == EXT2_ET_MAGIC_BLOCK_BITMAP) || \
@@ -100,7 +111,12 @@ struct ext2_bitmap_ops {
 	 * May be NULL, in which case a generic function is used. */
 	errcode_t (*find_first_set)(ext2fs_generic_bitmap_64 bitmap,
 				    __u64 start, __u64 end, __u64 *out);
+	/* Find the last set bit between start and end, inclusive.
+	 * May be NULL, in which case a generic function is used. */
+	errcode_t (*find_last_set)(ext2fs_generic_bitmap_64 bitmap,
+				   __u64 start, __u64 end, __u64 *out);
 };
 
 extern struct ext2_bitmap_ops ext2fs_blkmap64_bitarray;
 extern struct ext2_bitmap_ops ext2fs_blkmap64_rbtree;
+extern struct ext2_bitmap_ops ext2fs_blkmap64_roaring;
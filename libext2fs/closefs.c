@@ -32,7 +32,7 @@ static int test_root(unsigned int a, unsigned int b)
 	}
 }
 
-int ext2fs_bg_has_super(ext2_filsys fs, dgrp_t group)
+static int compute_has_super(ext2_filsys fs, dgrp_t group)
 {
 	if (group == 0)
 		return 1;
@@ -53,6 +53,120 @@ int ext2fs_bg_has_super(ext2_filsys fs, dgrp_t group)
 	return 0;
 }
 
+static __u32 layout_features(ext2_filsys fs)
+{
+	return (ext2fs_has_feature_sparse_super(fs->super) ? 1 : 0) |
+		(ext2fs_has_feature_sparse_super2(fs->super) ? 2 : 0);
+}
+
+/*
+ * Returns nonzero if fs->group_layout still describes the file system,
+ * that is if neither the number of groups nor any superblock field
+ * deciding where the backups go has changed since it was built.
+ */
+static int group_layout_current(ext2_filsys fs)
+{
+	struct ext2_group_layout *gl = fs->group_layout;
+
+	return gl && gl->group_count == fs->group_desc_count &&
+		gl->features == layout_features(fs) &&
+		gl->backup_bgs[0] == fs->super->s_backup_bgs[0] &&
+		gl->backup_bgs[1] == fs->super->s_backup_bgs[1];
+}
+
+static void layout_mark(unsigned char *has_super, dgrp_t count, __u64 group)
+{
+	if (group < count)
+		has_super[group >> 3] |= 1 << (group & 7);
+}
+
+/*
+ * (Re)build fs->group_layout if it is missing or out of date.  This is
+ * done when the file system is opened and before it is flushed; code
+ * resizing the file system should call it too, since until then
+ * lookups fall back on compute_has_super().
+ */
+errcode_t ext2fs_update_group_layout(ext2_filsys fs)
+{
+	struct ext2_group_layout *gl;
+	dgrp_t		count = fs->group_desc_count, group, n = 0;
+	__u64		root;
+	unsigned int	i;
+	static const unsigned int roots[] = { 3, 5, 7 };
+	errcode_t	retval;
+
+	if (group_layout_current(fs))
+		return 0;
+	ext2fs_free_group_layout(fs);
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_group_layout), &gl);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_memzero(count / 8 + 1, &gl->has_super);
+	if (retval)
+		goto errout;
+
+	/* The same groups compute_has_super() picks, without the search */
+	layout_mark(gl->has_super, count, 0);
+	if (ext2fs_has_feature_sparse_super2(fs->super)) {
+		layout_mark(gl->has_super, count, fs->super->s_backup_bgs[0]);
+		layout_mark(gl->has_super, count, fs->super->s_backup_bgs[1]);
+	} else if (!ext2fs_has_feature_sparse_super(fs->super)) {
+		for (group = 1; group < count; group++)
+			layout_mark(gl->has_super, count, group);
+	} else {
+		layout_mark(gl->has_super, count, 1);
+		for (i = 0; i < sizeof(roots) / sizeof(roots[0]); i++)
+			for (root = roots[i]; root < count; root *= roots[i])
+				layout_mark(gl->has_super, count, root);
+	}
+
+	for (group = 0; group < count; group++)
+		if (gl->has_super[group >> 3] & (1 << (group & 7)))
+			n++;
+	retval = ext2fs_get_array(n, sizeof(dgrp_t), &gl->super_groups);
+	if (retval)
+		goto errout;
+	for (group = 0, n = 0; group < count; group++)
+		if (gl->has_super[group >> 3] & (1 << (group & 7)))
+			gl->super_groups[n++] = group;
+
+	gl->num_super = n;
+	gl->group_count = count;
+	gl->features = layout_features(fs);
+	gl->backup_bgs[0] = fs->super->s_backup_bgs[0];
+	gl->backup_bgs[1] = fs->super->s_backup_bgs[1];
+	fs->group_layout = gl;
+	return 0;
+
+errout:
+	if (gl->has_super)
+		ext2fs_free_mem(&gl->has_super);
+	ext2fs_free_mem(&gl);
+	return retval;
+}
+
+void ext2fs_free_group_layout(ext2_filsys fs)
+{
+	struct ext2_group_layout *gl = fs->group_layout;
+
+	if (!gl)
+		return;
+	if (gl->super_groups)
+		ext2fs_free_mem(&gl->super_groups);
+	ext2fs_free_mem(&gl->has_super);
+	ext2fs_free_mem(&fs->group_layout);
+}
+
+int ext2fs_bg_has_super(ext2_filsys fs, dgrp_t group)
+{
+	struct ext2_group_layout *gl = fs->group_layout;
+
+	if (group < fs->group_desc_count && group_layout_current(fs))
+		return (gl->has_super[group >> 3] >> (group & 7)) & 1;
+	return compute_has_super(fs, group);
+}
+
 /*
  * ext2fs_super_and_bgd_loc2()
  * @fs:			ext2 fs pointer
@@ -269,6 +383,128 @@ static errcode_t write_backup_super(ext2_filsys fs, dgrp_t group,
 				    super_shadow);
 }
 
+/*
+ * Backup superblock fields that are left to go stale between
+ * flushes.  e2fsck does not compare them with the primary and
+ * recomputes them when it has to fall back on a backup.
+ */
+static int backup_super_changed(struct ext2_flush_state *fst,
+				struct ext2_super_block *super)
+{
+	struct ext2_super_block *old = &fst->super;
+
+	if (!fst->super_valid)
+		return 1;
+	old->s_free_blocks_count = super->s_free_blocks_count;
+	old->s_free_blocks_hi = super->s_free_blocks_hi;
+	old->s_free_inodes_count = super->s_free_inodes_count;
+	old->s_wtime = super->s_wtime;
+	old->s_wtime_hi = super->s_wtime_hi;
+	old->s_kbytes_written = super->s_kbytes_written;
+	old->s_block_group_nr = super->s_block_group_nr;
+	old->s_checksum = super->s_checksum;
+	return memcmp(old, super, SUPERBLOCK_SIZE) != 0;
+}
+
+/*
+ * Mark the descriptor blocks that differ from what was last written,
+ * and return how many there are.
+ */
+static blk64_t desc_blocks_changed(ext2_filsys fs,
+				   struct ext2_flush_state *fst,
+				   const char *group_ptr, char *changed)
+{
+	blk64_t	i, num = 0;
+	int	valid = fst && fst->desc && fst->desc_blocks == fs->desc_blocks;
+
+	for (i = 0; i < fs->desc_blocks; i++) {
+		changed[i] = !valid ||
+			memcmp(fst->desc + i * fs->blocksize,
+			       group_ptr + i * fs->blocksize, fs->blocksize);
+		if (changed[i])
+			num++;
+	}
+	return num;
+}
+
+/*
+ * Write the changed blocks among num descriptor blocks starting at
+ * descriptor block first, which live on disk starting at blk.
+ */
+static errcode_t write_desc_blocks(ext2_filsys fs, blk64_t blk,
+				   blk64_t first, blk64_t num,
+				   const char *group_ptr, const char *changed)
+{
+	blk64_t		i, j;
+	errcode_t	retval;
+
+	for (i = 0; i < num; i = j) {
+		if (!changed[first + i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < num && changed[first + j]; j++)
+			;
+		retval = io_channel_write_blk64(fs->io, blk + i, j - i,
+				group_ptr + (first + i) * fs->blocksize);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Remember what ext2fs_flush2() has just written.  Any failure to do
+ * so only costs a full rewrite on the next flush.
+ */
+static void flush_state_update(ext2_filsys fs,
+			       struct ext2_super_block *super_shadow,
+			       const char *group_ptr)
+{
+	struct ext2_flush_state *fst = fs->flush_state;
+	size_t size = (size_t) fs->desc_blocks * fs->blocksize;
+
+	if (!fst) {
+		if (ext2fs_get_memzero(sizeof(*fst), &fst))
+			return;
+		fs->flush_state = fst;
+	}
+
+	if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY)) {
+		memcpy(&fst->super, super_shadow, SUPERBLOCK_SIZE);
+		fst->super_valid = 1;
+	}
+	if (fs->flags & EXT2_FLAG_SUPER_ONLY)
+		return;
+
+	/*
+	 * With only the primary descriptors written, the backups no
+	 * longer match them, so nothing can be skipped next time.
+	 */
+	if ((fs->flags & EXT2_FLAG_MASTER_SB_ONLY) ||
+	    (fst->desc && fst->desc_blocks != fs->desc_blocks)) {
+		if (fst->desc)
+			ext2fs_free_mem(&fst->desc);
+		if (fs->flags & EXT2_FLAG_MASTER_SB_ONLY)
+			return;
+	}
+	if (!fst->desc && ext2fs_get_mem(size, &fst->desc))
+		return;
+	memcpy(fst->desc, group_ptr, size);
+	fst->desc_blocks = fs->desc_blocks;
+}
+
+void ext2fs_flush_state_release(ext2_filsys fs)
+{
+	struct ext2_flush_state *fst = fs->flush_state;
+
+	if (!fst)
+		return;
+	if (fst->desc)
+		ext2fs_free_mem(&fst->desc);
+	ext2fs_free_mem(&fs->flush_state);
+}
+
 errcode_t ext2fs_flush(ext2_filsys fs)
 {
 	return ext2fs_flush2(fs, 0);
@@ -276,7 +512,7 @@ errcode_t ext2fs_flush(ext2_filsys fs)
 
 errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 {
-	dgrp_t		i;
+	dgrp_t		i, n;
 	errcode_t	retval;
 	unsigned long	fs_state;
 	__u32		feature_incompat;
@@ -287,7 +523,10 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	dgrp_t		j;
 #endif
 	char	*group_ptr;
-	blk64_t	old_desc_blocks;
+	char	*changed = NULL;
+	blk64_t	old_desc_blocks, num_changed = 0;
+	int	write_super;
+	struct ext2_flush_state *fst;
 	struct ext2fs_numeric_progress_struct progress;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
@@ -297,6 +536,14 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	    fs->group_desc == NULL)
 		return EXT2_ET_NO_GDESC;
 
+	/*
+	 * Data held back for delayed allocation is written first, since
+	 * allocating it changes the bitmaps and the free counts.
+	 */
+	retval = ext2fs_file_flush_delalloc(fs);
+	if (retval)
+		return retval;
+
 	fs_state = fs->super->s_state;
 	feature_incompat = fs->super->s_feature_incompat;
 
@@ -311,7 +558,10 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	 *
 	 * Bitmap checksums live in the group descriptor, so the
 	 * bitmaps need to be written before the descriptors.
+	 *
+	 * Preallocation windows of open files must not reach disk.
 	 */
+	ext2fs_file_release_prealloc(fs);
 	if (fs->write_bitmaps) {
 		retval = fs->write_bitmaps(fs);
 		if (retval)
@@ -373,39 +623,67 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	} else
 		old_desc_blocks = fs->desc_blocks;
 
+	retval = ext2fs_update_group_layout(fs);
+	if (retval)
+		goto errout;
+
+	/*
+	 * Work out what actually needs writing.  Backup superblocks
+	 * are rewritten only when something other than the counters
+	 * changed, and only the descriptor blocks that changed are
+	 * rewritten, in each copy.
+	 */
+	fst = fs->flush_state;
+	write_super = !(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&
+		(!fst || backup_super_changed(fst, super_shadow));
+	if (!(fs->flags & EXT2_FLAG_SUPER_ONLY)) {
+		retval = ext2fs_get_mem(fs->desc_blocks, &changed);
+		if (retval)
+			goto errout;
+		num_changed = desc_blocks_changed(fs, fst, group_ptr, changed);
+	}
+
 	if (fs->progress_ops && fs->progress_ops->init)
 		(fs->progress_ops->init)(fs, &progress, NULL,
 					 fs->group_desc_count);
 
+	/*
+	 * The backup superblocks are written first, in one ascending
+	 * pass.  Being partial-block writes they bypass the I/O cache
+	 * and flush it; grouping them means the cache is flushed once
+	 * rather than between every pair of descriptor writes.  The
+	 * descriptor blocks follow in a second ascending pass.
+	 */
+	for (n = 1; write_super && n < fs->group_layout->num_super; n++) {
+		i = fs->group_layout->super_groups[n];
+		retval = write_backup_super(fs, i,
+					    ext2fs_group_first_block2(fs, i),
+					    super_shadow);
+		if (retval)
+			goto errout;
+	}
 
-	for (i = 0; i < fs->group_desc_count; i++) {
-		blk64_t	super_blk, old_desc_blk, new_desc_blk;
+	for (i = 0; num_changed && i < fs->group_desc_count; i++) {
+		blk64_t	old_desc_blk, new_desc_blk;
 
 		if (fs->progress_ops && fs->progress_ops->update)
 			(fs->progress_ops->update)(fs, &progress, i);
-		ext2fs_super_and_bgd_loc2(fs, i, &super_blk, &old_desc_blk,
+		ext2fs_super_and_bgd_loc2(fs, i, 0, &old_desc_blk,
 					 &new_desc_blk, 0);
 
-		if (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) &&i && super_blk) {
-			retval = write_backup_super(fs, i, super_blk,
-						    super_shadow);
-			if (retval)
-				goto errout;
-		}
-		if (fs->flags & EXT2_FLAG_SUPER_ONLY)
-			continue;
 		if ((old_desc_blk) &&
 		    (!(fs->flags & EXT2_FLAG_MASTER_SB_ONLY) || (i == 0))) {
-			retval = io_channel_write_blk64(fs->io,
-			      old_desc_blk, old_desc_blocks, group_ptr);
+			retval = write_desc_blocks(fs, old_desc_blk, 0,
+						   old_desc_blocks, group_ptr,
+						   changed);
 			if (retval)
 				goto errout;
 		}
 		if (new_desc_blk) {
 			int meta_bg = i / EXT2_DESC_PER_BLOCK(fs->super);
 
-			retval = io_channel_write_blk64(fs->io, new_desc_blk,
-				1, group_ptr + (meta_bg*fs->blocksize));
+			retval = write_desc_blocks(fs, new_desc_blk, meta_bg,
+						   1, group_ptr, changed);
 			if (retval)
 				goto errout;
 		}
@@ -414,6 +692,8 @@ errcode_t ext2fs_flush2(ext2_filsys fs, int flags)
 	if (fs->progress_ops && fs->progress_ops->close)
 		(fs->progress_ops->close)(fs, &progress, NULL);
 
+	flush_state_update(fs, super_shadow, group_ptr);
+
 write_primary_superblock_only:
 	/*
 	 * Write out master superblock.  This has to be done
@@ -433,7 +713,7 @@ write_primary_superblock_only:
 
 	retval = ext2fs_superblock_csum_set(fs, super_shadow);
 	if (retval)
-		return retval;
+		goto errout;
 
 	if (!(flags & EXT2_FLAG_FLUSH_NO_SYNC)) {
 		retval = io_channel_flush(fs->io);
@@ -453,6 +733,10 @@ write_primary_superblock_only:
 	}
 errout:
 	fs->super->s_state = fs_state;
+	if (changed)
+		ext2fs_free_mem(&changed);
+	if (retval)
+		ext2fs_flush_state_release(fs);
 #ifdef WORDS_BIGENDIAN
 	if (super_shadow)
 		ext2fs_free_mem(&super_shadow);
@@ -487,6 +771,7 @@ errcode_t ext2fs_close2(ext2_filsys fs, int flags)
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	ext2fs_file_release_prealloc(fs);
 	if (fs->write_bitmaps) {
 		retval = fs->write_bitmaps(fs);
 		if (retval)
@@ -16,7 +16,7 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "crc16.h"
 
 #ifndef offsetof
@@ -647,16 +647,21 @@ static errcode_t ext2fs_inode_csum(ext2_filsys fs, ext2_ino_t inum,
 	return 0;
 }
 
-int ext2fs_inode_csum_verify(ext2_filsys fs, ext2_ino_t inum,
-			     struct ext2_inode_large *inode)
+/*
+ * Return 1 only if the stored checksum of an inode (in disk byte order)
+ * really matches its contents.  Unlike ext2fs_inode_csum_verify() this
+ * does not accept an all-zero inode, so a match means the stored value
+ * can serve as the base of an incremental update.
+ */
+int ext2fs_inode_csum_matches(ext2_filsys fs, ext2_ino_t inum,
+			      struct ext2_inode_large *inode)
 {
 	errcode_t retval;
 	__u32 provided, calculated;
-	unsigned int i, has_hi;
-	char *cp;
+	unsigned int has_hi;
 
 	if (!ext2fs_has_feature_metadata_csum(fs->super))
-		return 1;
+		return 0;
 
 	has_hi = (EXT2_INODE_SIZE(fs->super) > EXT2_GOOD_OLD_INODE_SIZE &&
 		  inode->i_extra_isize >= EXT4_INODE_CSUM_HI_EXTRA_END);
@@ -671,7 +676,19 @@ int ext2fs_inode_csum_verify(ext2_filsys fs, ext2_ino_t inum,
 	} else
 		calculated &= 0xFFFF;
 
-	if (provided == calculated)
+	return provided == calculated;
+}
+
+int ext2fs_inode_csum_verify(ext2_filsys fs, ext2_ino_t inum,
+			     struct ext2_inode_large *inode)
+{
+	unsigned int i;
+	char *cp;
+
+	if (!ext2fs_has_feature_metadata_csum(fs->super))
+		return 1;
+
+	if (ext2fs_inode_csum_matches(fs, inum, inode))
 		return 1;
 
 	/*
@@ -712,7 +729,75 @@ errcode_t ext2fs_inode_csum_set(ext2_filsys fs, ext2_ino_t inum,
 	return 0;
 }
 
-__u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
+/*
+ * Compute the checksum of an inode from an earlier version of it whose
+ * stored checksum is known to match its contents, rehashing only the
+ * bytes from the first to the last that changed.  Both inodes are in
+ * disk byte order.  Returns 0 if the checksum has to be computed from
+ * scratch instead, which is the case unless both versions carry the
+ * full 32-bit checksum and the same generation.
+ */
+int ext2fs_inode_csum_update(ext2_filsys fs, struct ext2_inode_large *inode,
+			     const struct ext2_inode_large *old)
+{
+	const unsigned char *np = (const unsigned char *) inode;
+	const unsigned char *op = (const unsigned char *) old;
+	size_t size = EXT2_INODE_SIZE(fs->super);
+	size_t lo_off = offsetof(struct ext2_inode_large, i_checksum_lo);
+	size_t hi_off = offsetof(struct ext2_inode_large, i_checksum_hi);
+	size_t first, last, i, j, n;
+	unsigned char delta[64];
+	__u32 crc, diff = 0;
+
+#define CSUM_BYTE(i)	((i) == lo_off || (i) == lo_off + 1 || \
+			 (i) == hi_off || (i) == hi_off + 1)
+
+	if (!ext2fs_has_feature_metadata_csum(fs->super) ||
+	    size <= EXT2_GOOD_OLD_INODE_SIZE ||
+	    ext2fs_le16_to_cpu(inode->i_extra_isize) <
+	    EXT4_INODE_CSUM_HI_EXTRA_END ||
+	    inode->i_extra_isize != old->i_extra_isize ||
+	    inode->i_generation != old->i_generation)
+		return 0;
+
+	for (first = 0; first < size; first++)
+		if (np[first] != op[first] && !CSUM_BYTE(first))
+			break;
+
+	crc = ext2fs_le16_to_cpu(old->i_checksum_lo) |
+		((__u32) ext2fs_le16_to_cpu(old->i_checksum_hi) << 16);
+	if (first < size) {
+		for (last = size - 1; last > first; last--)
+			if (np[last] != op[last] && !CSUM_BYTE(last))
+				break;
+		for (i = first; i <= last; i += n) {
+			n = last + 1 - i;
+			if (n > sizeof(delta))
+				n = sizeof(delta);
+			for (j = 0; j < n; j++)
+				delta[j] = CSUM_BYTE(i + j) ? 0 :
+					np[i + j] ^ op[i + j];
+			diff = ext2fs_crc32c_le(diff, delta, n);
+		}
+		crc ^= ext2fs_crc32c_zeros(diff, size - 1 - last);
+	}
+#undef CSUM_BYTE
+
+	inode->i_checksum_lo = ext2fs_cpu_to_le16(crc & 0xFFFF);
+	inode->i_checksum_hi = ext2fs_cpu_to_le16(crc >> 16);
+	return 1;
+}
+
+/* The part of the crc16 group descriptor checksum shared by all groups */
+static crc16_t group_desc_uuid_crc16(ext2_filsys fs)
+{
+	if (ext2fs_has_feature_metadata_csum(fs->super))
+		return 0;
+	return ext2fs_crc16(~0, fs->super->s_uuid,
+			    sizeof(fs->super->s_uuid));
+}
+
+static __u16 group_desc_csum(ext2_filsys fs, dgrp_t group, crc16_t uuid_crc)
 {
 	struct ext2_group_desc *desc = ext2fs_group_desc(fs, fs->group_desc,
 							 group);
@@ -757,9 +842,7 @@ __u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
 
 	/* old crc16 code */
 	offset = offsetof(struct ext2_group_desc, bg_checksum);
-	crc = ext2fs_crc16(~0, fs->super->s_uuid,
-			   sizeof(fs->super->s_uuid));
-	crc = ext2fs_crc16(crc, &group, sizeof(group));
+	crc = ext2fs_crc16(uuid_crc, &group, sizeof(group));
 	crc = ext2fs_crc16(crc, desc, offset);
 	offset += sizeof(desc->bg_checksum); /* skip checksum */
 	/* for checksum of struct ext4_group_desc do the rest...*/
@@ -782,6 +865,11 @@ out:
 	return crc;
 }
 
+__u16 ext2fs_group_desc_csum(ext2_filsys fs, dgrp_t group)
+{
+	return group_desc_csum(fs, group, group_desc_uuid_crc16(fs));
+}
+
 int ext2fs_group_desc_csum_verify(ext2_filsys fs, dgrp_t group)
 {
 	if (ext2fs_has_group_desc_csum(fs) &&
@@ -805,25 +893,29 @@ void ext2fs_group_desc_csum_set(ext2_filsys fs, dgrp_t group)
 static __u32 find_last_inode_ingrp(ext2fs_inode_bitmap bitmap,
 				   __u32 inodes_per_grp, dgrp_t grp_no)
 {
-	ext2_ino_t i, start_ino, end_ino;
+	ext2_ino_t ino, start_ino, end_ino;
 
 	start_ino = grp_no * inodes_per_grp + 1;
 	end_ino = start_ino + inodes_per_grp - 1;
 
-	for (i = end_ino; i >= start_ino; i--) {
-		if (ext2fs_fast_test_inode_bitmap2(bitmap, i))
-			return i - start_ino + 1;
-	}
-	return inodes_per_grp;
+	if (ext2fs_find_last_set_inode_bitmap2(bitmap, start_ino, end_ino,
+					       &ino))
+		return inodes_per_grp;
+	return ino - start_ino + 1;
 }
 
 /* update the bitmap flags, set the itable high watermark, and calculate
- * checksums for the group descriptors */
+ * checksums for the group descriptors
+ *
+ * After one full pass only the groups marked GROUP_GDT_DIRTY by the
+ * allocation statistics functions are revisited, until something
+ * changes a whole bitmap (and so clears EXT2_FLAG_GDT_CSUM_CLEAN). */
 errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 {
 	struct ext2_super_block *sb = fs->super;
-	int dirty = 0;
+	int dirty = 0, incremental;
 	dgrp_t i;
+	crc16_t uuid_crc;
 
 	if (!fs->inode_map)
 		return EXT2_ET_NO_INODE_BITMAP;
@@ -831,12 +923,27 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 	if (!ext2fs_has_group_desc_csum(fs))
 		return 0;
 
+	/* Checksum the uuid once rather than for every group */
+	uuid_crc = group_desc_uuid_crc16(fs);
+
+	incremental = (fs->flags & EXT2_FLAG_GDT_CSUM_CLEAN) &&
+		!(fs->flags & (EXT2_FLAG_IB_DIRTY | EXT2_FLAG_BB_DIRTY));
+
 	for (i = 0; i < fs->group_desc_count; i++) {
-		__u32 old_csum = ext2fs_bg_checksum(fs, i);
-		__u32 old_unused = ext2fs_bg_itable_unused(fs, i);
-		__u32 old_flags = ext2fs_bg_flags(fs, i);
-		__u32 old_free_inodes_count = ext2fs_bg_free_inodes_count(fs, i);
-		__u32 old_free_blocks_count = ext2fs_bg_free_blocks_count(fs, i);
+		__u32 old_csum, old_unused, old_flags;
+		__u32 old_free_inodes_count, old_free_blocks_count;
+
+		if (incremental && (!fs->dirty_groups ||
+				    !(fs->dirty_groups[i] & GROUP_GDT_DIRTY)))
+			continue;
+		if (fs->dirty_groups)
+			fs->dirty_groups[i] &= ~GROUP_GDT_DIRTY;
+
+		old_csum = ext2fs_bg_checksum(fs, i);
+		old_unused = ext2fs_bg_itable_unused(fs, i);
+		old_flags = ext2fs_bg_flags(fs, i);
+		old_free_inodes_count = ext2fs_bg_free_inodes_count(fs, i);
+		old_free_blocks_count = ext2fs_bg_free_blocks_count(fs, i);
 
 		if (old_free_blocks_count == sb->s_blocks_per_group &&
 		    i != fs->group_desc_count - 1)
@@ -855,7 +962,7 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 			ext2fs_bg_itable_unused_set(fs, i, unused);
 		}
 
-		ext2fs_group_desc_csum_set(fs, i);
+		ext2fs_bg_checksum_set(fs, i, group_desc_csum(fs, i, uuid_crc));
 		if (old_flags != ext2fs_bg_flags(fs, i))
 			dirty = 1;
 		if (old_unused != ext2fs_bg_itable_unused(fs, i))
@@ -863,6 +970,7 @@ errcode_t ext2fs_set_gdt_csum(ext2_filsys fs)
 		if (old_csum != ext2fs_bg_checksum(fs, i))
 			dirty = 1;
 	}
+	fs->flags |= EXT2_FLAG_GDT_CSUM_CLEAN;
 	if (dirty)
 		ext2fs_mark_super_dirty(fs);
 	return 0;
@@ -0,0 +1,186 @@
+/*
+ * dedup.c --- content index of data blocks for EXT2_FLAG_SHARE_DUP
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <string.h>
+#include <sys/errno.h>
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+
+/*
+ * Blocks written while EXT2_FLAG_SHARE_DUP is set are looked up by
+ * content, so that identical blocks end up sharing one physical
+ * block.  The index is an open-addressed table of fixed-size slots
+ * keyed on a prefix of the block's SHA-512.  The digest is already
+ * uniformly distributed, so its first word picks the home slot
+ * directly.  The table doubles once it is three quarters full, which
+ * keeps probe sequences short however many blocks are indexed, and
+ * entries need no allocation of their own.
+ *
+ * A match is only a hint: ext2fs_dedup_find() checks that the block
+ * is still in use and still holds the same data before handing it
+ * out.  Neither a truncated key nor a block rewritten after it was
+ * indexed can therefore cause the wrong block to be shared.
+ */
+
+#define DEDUP_KEY_LEN		16
+#define DEDUP_KEY_WORDS		(DEDUP_KEY_LEN / sizeof(__u64))
+#define DEDUP_MIN_SLOTS		4096
+
+struct dedup_slot {
+	__u64	key[DEDUP_KEY_WORDS];
+	blk64_t	blk;			/* 0 if the slot is free */
+};
+
+struct ext2_dedup_index {
+	struct dedup_slot	*slots;
+	__u64			mask;	/* number of slots - 1 */
+	__u64			count;
+	char			*buf;	/* one block, for checking matches */
+};
+
+static struct dedup_slot *dedup_probe(struct ext2_dedup_index *idx,
+				      const __u64 *key)
+{
+	struct dedup_slot	*s;
+	__u64			i = key[0] & idx->mask;
+
+	for (;;) {
+		s = &idx->slots[i];
+		if (!s->blk || (s->key[0] == key[0] && s->key[1] == key[1]))
+			return s;
+		i = (i + 1) & idx->mask;
+	}
+}
+
+static errcode_t dedup_grow(struct ext2_dedup_index *idx)
+{
+	struct dedup_slot	*old = idx->slots;
+	__u64			i, nslots = idx->mask + 1;
+	errcode_t		retval;
+
+	retval = ext2fs_get_arrayzero(nslots * 2, sizeof(struct dedup_slot),
+				      &idx->slots);
+	if (retval) {
+		idx->slots = old;
+		return retval;
+	}
+	idx->mask = nslots * 2 - 1;
+	for (i = 0; i < nslots; i++) {
+		if (old[i].blk)
+			*dedup_probe(idx, old[i].key) = old[i];
+	}
+	ext2fs_free_mem(&old);
+	return 0;
+}
+
+static void dedup_insert(struct ext2_dedup_index *idx,
+			 const unsigned char *key_bytes, blk64_t blk)
+{
+	struct dedup_slot	*s;
+	__u64			key[DEDUP_KEY_WORDS];
+	__u64			nslots = idx->mask + 1;
+
+	/*
+	 * The index is only an optimization.  If it cannot grow, let
+	 * it fill up a little further and then stop indexing new
+	 * blocks rather than fail the write.
+	 */
+	if ((idx->count + 1) * 4 > nslots * 3 && dedup_grow(idx) &&
+	    (idx->count + 1) * 8 > nslots * 7)
+		return;
+
+	memcpy(key, key_bytes, DEDUP_KEY_LEN);
+	s = dedup_probe(idx, key);
+	if (!s->blk) {
+		memcpy(s->key, key, DEDUP_KEY_LEN);
+		idx->count++;
+	}
+	s->blk = blk;
+}
+
+errcode_t ext2fs_dedup_create(ext2_filsys fs)
+{
+	struct ext2_dedup_index	*idx;
+	errcode_t		retval;
+
+	retval = ext2fs_get_memzero(sizeof(struct ext2_dedup_index), &idx);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_arrayzero(DEDUP_MIN_SLOTS,
+				      sizeof(struct dedup_slot), &idx->slots);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_mem(fs->blocksize, &idx->buf);
+	if (retval)
+		goto errout;
+	idx->mask = DEDUP_MIN_SLOTS - 1;
+	fs->dedup = idx;
+	return 0;
+
+errout:
+	if (idx->slots)
+		ext2fs_free_mem(&idx->slots);
+	ext2fs_free_mem(&idx);
+	return retval;
+}
+
+void ext2fs_dedup_free(ext2_filsys fs)
+{
+	struct ext2_dedup_index	*idx = fs->dedup;
+
+	if (!idx)
+		return;
+	ext2fs_free_mem(&idx->slots);
+	if (idx->buf)
+		ext2fs_free_mem(&idx->buf);
+	ext2fs_free_mem(&idx);
+	fs->dedup = NULL;
+}
+
+/*
+ * Return an in-use block whose contents equal data, whose SHA-512 is
+ * sha, or 0 if none is known.
+ */
+blk64_t ext2fs_dedup_find(ext2_filsys fs, const void *data,
+			  const unsigned char *sha)
+{
+	struct ext2_dedup_index	*idx = fs->dedup;
+	struct dedup_slot	*s;
+	__u64			key[DEDUP_KEY_WORDS];
+
+	if (!idx || !fs->block_map)
+		return 0;
+
+	memcpy(key, sha, DEDUP_KEY_LEN);
+	s = dedup_probe(idx, key);
+	if (!s->blk)
+		return 0;
+
+	if (s->blk < fs->super->s_first_data_block ||
+	    s->blk >= ext2fs_blocks_count(fs->super) ||
+	    !ext2fs_test_block_bitmap2(fs->block_map, s->blk))
+		return 0;
+	if (io_channel_read_blk64(fs->io, s->blk, 1, idx->buf))
+		return 0;
+	if (memcmp(idx->buf, data, fs->blocksize))
+		return 0;
+	return s->blk;
+}
+
+/*
+ * Record that blk holds the data whose SHA-512 is sha, replacing any
+ * older block indexed under the same key.
+ */
+void ext2fs_dedup_add(ext2_filsys fs, const unsigned char *sha, blk64_t blk)
+{
+	if (fs->dedup)
+		dedup_insert(fs->dedup, sha, blk);
+}
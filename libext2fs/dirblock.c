@@ -17,23 +17,66 @@
 #include <sys/time.h>
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
+
+static int dir_block_verify(void *buf, void *priv)
+{
+	struct ext2_verify_ctx *ctx = priv;
+
+	return ext2fs_dir_block_csum_verify(ctx->fs, ctx->ino,
+					    (struct ext2_dir_entry *)buf);
+}
+
+/*
+ * Look up the generation of a directory for its verify tag.  Blocks of
+ * one directory are read in runs, so remember the last directory
+ * instead of going through ext2fs_read_inode() for every block.  The
+ * inode number and generation share one word so that no reader sees a
+ * mismatched pair; ext2fs_write_inode2() keeps it up to date.
+ */
+static errcode_t dir_generation(ext2_filsys fs, ext2_ino_t ino, __u32 *gen)
+{
+	unsigned long long tag = fs->dir_verify_tag;
+	struct ext2_inode inode;
+	errcode_t retval;
+
+	if (tag && (ext2_ino_t) tag == ino) {
+		*gen = tag >> 32;
+		return 0;
+	}
+	retval = ext2fs_read_inode(fs, ino, &inode);
+	if (retval)
+		return retval;
+	*gen = inode.i_generation;
+	fs->dir_verify_tag = EXT2_VERIFY_TAG(ino, *gen);
+	return 0;
+}
 
 errcode_t ext2fs_read_dir_block4(ext2_filsys fs, blk64_t block,
 				 void *buf, int flags EXT2FS_ATTR((unused)),
 				 ext2_ino_t ino)
 {
+	struct ext2_verify_ctx ctx = { fs, ino, block };
+	__u32		gen = 0;
 	errcode_t	retval;
-	int		corrupt = 0;
-
-	retval = io_channel_read_blk64(fs->io, block, 1, buf);
+	int		verified = 1;
+	int		corrupt;
+
+	if (fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)
+		retval = io_channel_read_blk64(fs->io, block, 1, buf);
+	else if (!ext2fs_has_feature_metadata_csum(fs->super))
+		retval = io_channel_read_blk64(fs->io, block, 1, buf);
+	else if (ino && dir_generation(fs, ino, &gen)) {
+		/* The check will fail too; don't let it be cached */
+		retval = io_channel_read_blk64(fs->io, block, 1, buf);
+		verified = retval ? 0 : dir_block_verify(buf, &ctx);
+	} else
+		retval = io_channel_read_blk64_verify(fs->io, block, buf,
+				EXT2_VERIFY_TAG(ino, gen),
+				dir_block_verify, &ctx, &verified);
 	if (retval)
 		return retval;
-
-	if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-	    !ext2fs_dir_block_csum_verify(fs, ino,
-					  (struct ext2_dir_entry *)buf))
-		corrupt = 1;
+	corrupt = !verified;
 
 #ifdef WORDS_BIGENDIAN
 	retval = ext2fs_dirent_swab_in(fs, buf, flags);
@@ -71,6 +71,12 @@ struct struct_io_stats {
 	unsigned long long	bytes_written;
 };
 
+/*
+ * Checks the contents of a block just read; returns nonzero if they
+ * are good.  See io_channel_read_blk64_verify().
+ */
+typedef int (*io_verify_func)(void *data, void *priv);
+
 struct struct_io_manager {
 	errcode_t magic;
 	const char *name;
@@ -99,7 +105,12 @@ struct struct_io_manager {
 				     unsigned long long count);
 	errcode_t (*zeroout)(io_channel channel, unsigned long long block,
 			     unsigned long long count);
-	long	reserved[14];
+	errcode_t (*read_blk_verify)(io_channel channel,
+				     unsigned long long block, void *data,
+				     unsigned long long tag,
+				     io_verify_func verify, void *priv,
+				     int *verified);
+	long	reserved[13];
 };
 
 #define IO_FLAG_RW		0x0001
@@ -142,6 +153,12 @@ extern errcode_t io_channel_alloc_buf(io_channel channel,
 extern errcode_t io_channel_cache_readahead(io_channel io,
 					    unsigned long long block,
 					    unsigned long long count);
+extern errcode_t io_channel_read_blk64_verify(io_channel channel,
+					      unsigned long long block,
+					      void *data,
+					      unsigned long long tag,
+					      io_verify_func verify,
+					      void *priv, int *verified);
 
 /* Note: only this one is supported */
 /* xnu_io.c */
@@ -210,6 +210,9 @@ typedef struct ext2_file *ext2_file_t;
 #define EXT2_FLAG_IBITMAP_TAIL_PROBLEM    0x2000000
 #define EXT2_FLAG_THREADS        0x4000000
 #define EXT2_FLAG_IGNORE_SWAP_DIRENT    0x8000000
+#define EXT2_FLAG_BB_GROUP_DIRTY    0x10000000
+#define EXT2_FLAG_IB_GROUP_DIRTY    0x20000000
+#define EXT2_FLAG_GDT_CSUM_CLEAN    0x40000000
 
 /*
  * Special flag in the ext2 inode i_flag field that means that this is
@@ -317,10 +320,38 @@ struct struct_ext2_filsys {
     void (*block_alloc_stats_range)(ext2_filsys fs, blk64_t blk, blk_t num,
                                     int inuse);
     
-    /* hashmap for SHA of data blocks */
-    struct ext2fs_hashmap* block_sha_map;
+    /* Content index of data blocks, for EXT2_FLAG_SHARE_DUP */
+    struct ext2_dedup_index    *dedup;
     
     const struct ext2fs_nls_table *encoding;
+    
+    /* Cache of verified extent tree blocks */
+    struct ext2_extent_cache    *ecache;
+    
+    /* Directory last read by ext2fs_read_dir_block4(), as
+       EXT2_VERIFY_TAG(ino, generation) */
+    unsigned long long        dir_verify_tag;
+    
+    /* Index of free block extents used by ext2fs_new_range() */
+    struct ext2_free_extents    *free_extents;
+    
+    /* Per-group free space summaries used by the block allocator */
+    struct ext2_group_summaries    *group_summaries;
+    
+    /* Open files holding block preallocation windows */
+    struct ext2_file        *prealloc_files;
+    
+    /* Open files with blocks pending delayed allocation */
+    struct ext2_file        *delalloc_files;
+    
+    /* Groups whose bitmaps or descriptors changed (GROUP_*_DIRTY) */
+    unsigned char        *dirty_groups;
+    
+    /* Metadata as last written by ext2fs_flush2() */
+    struct ext2_flush_state    *flush_state;
+    
+    /* Groups with backup superblocks, see ext2fs_bg_has_super() */
+    struct ext2_group_layout    *group_layout;
 };
 
 #if EXT2_FLAT_INCLUDES
@@ -335,6 +366,7 @@ struct struct_ext2_filsys {
 #define EXT2FS_BMAP64_BITARRAY    1
 #define EXT2FS_BMAP64_RBTREE    2
 #define EXT2FS_BMAP64_AUTODIR    3
+#define EXT2FS_BMAP64_ROARING    4
 
 /*
  * Return flags for the block iterator functions
@@ -706,7 +738,9 @@ struct ext2_xattr_handle;
 #define EXT2FS_BITMAPS_WRITE        0x0001
 #define EXT2FS_BITMAPS_BLOCK        0x0002
 #define EXT2FS_BITMAPS_INODE        0x0004
-#define EXT2FS_BITMAPS_VALID_FLAGS    0x0007
+#define EXT2FS_BITMAPS_LAZY        0x0008
+#define EXT2FS_BITMAPS_PREFETCH        0x0010
+#define EXT2FS_BITMAPS_VALID_FLAGS    0x001f
 
 /*
  * function prototypes
@@ -1026,6 +1060,10 @@ extern errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino,
                               struct ext2_inode *inode,
                               char *block_buf, int bmap_flags, blk64_t block,
                               int *ret_flags, blk64_t *phys_blk);
+extern errcode_t ext2fs_bmap_range(ext2_filsys fs, ext2_ino_t ino,
+                                   struct ext2_inode *inode, char *block_buf,
+                                   blk64_t block, blk64_t count,
+                                   blk64_t *phys_blks, blk64_t *ret_count);
 errcode_t ext2fs_map_cluster_block(ext2_filsys fs, ext2_ino_t ino,
                                    struct ext2_inode *inode, blk64_t lblk,
                                    blk64_t *pblk);
@@ -1065,6 +1103,8 @@ extern void ext2fs_update_dynamic_rev(ext2_filsys fs);
 /* crc32c.c */
 extern __u32 ext2fs_crc32_be(__u32 crc, unsigned char const *p, size_t len);
 extern __u32 ext2fs_crc32c_le(__u32 crc, unsigned char const *p, size_t len);
+extern __u32 ext2fs_crc32c_zeros(__u32 crc, size_t len);
+extern __u32 ext2fs_crc32c_combine(__u32 crc1, __u32 crc2, size_t len2);
 
 /* csum.c */
 extern void ext2fs_init_csum_seed(ext2_filsys fs);
@@ -1338,6 +1378,9 @@ extern errcode_t ext2fs_extent_insert(ext2_extent_handle_t handle, int flags,
 extern errcode_t ext2fs_extent_set_bmap(ext2_extent_handle_t handle,
                                         blk64_t logical, blk64_t physical,
                                         int flags);
+extern errcode_t ext2fs_extent_set_bmap_range(ext2_extent_handle_t handle,
+                                              blk64_t lblk, blk64_t pblk,
+                                              blk64_t len, int flags);
 extern errcode_t ext2fs_extent_delete(ext2_extent_handle_t handle, int flags);
 extern errcode_t ext2fs_extent_get_info(ext2_extent_handle_t handle,
                                         struct ext2_extent_info *info);
@@ -1353,6 +1396,7 @@ extern errcode_t ext2fs_count_blocks(ext2_filsys fs, ext2_ino_t ino,
                                      struct ext2_inode *inode, blk64_t *ret_count);
 extern errcode_t ext2fs_decode_extent(struct ext2fs_extent *to, void *from,
                                       int len);
+extern void ext2fs_free_extent_cache(ext2_filsys fs);
 
 /* fallocate.c */
 #define EXT2_FALLOCATE_ZERO_BLOCKS    (0x1)
@@ -2024,6 +2068,7 @@ _INLINE_ int ext2fs_test_valid(ext2_filsys fs)
 _INLINE_ void ext2fs_mark_ib_dirty(ext2_filsys fs)
 {
     fs->flags |= EXT2_FLAG_IB_DIRTY | EXT2_FLAG_CHANGED;
+    fs->flags &= ~EXT2_FLAG_GDT_CSUM_CLEAN;
 }
 
 /*
@@ -2032,6 +2077,7 @@ _INLINE_ void ext2fs_mark_ib_dirty(ext2_filsys fs)
 _INLINE_ void ext2fs_mark_bb_dirty(ext2_filsys fs)
 {
     fs->flags |= EXT2_FLAG_BB_DIRTY | EXT2_FLAG_CHANGED;
+    fs->flags &= ~EXT2_FLAG_GDT_CSUM_CLEAN;
 }
 
 /*
@@ -2039,7 +2085,7 @@ _INLINE_ void ext2fs_mark_bb_dirty(ext2_filsys fs)
  */
 _INLINE_ int ext2fs_test_ib_dirty(ext2_filsys fs)
 {
-    return (fs->flags & EXT2_FLAG_IB_DIRTY);
+    return (fs->flags & (EXT2_FLAG_IB_DIRTY | EXT2_FLAG_IB_GROUP_DIRTY));
 }
 
 /*
@@ -2047,7 +2093,7 @@ _INLINE_ int ext2fs_test_ib_dirty(ext2_filsys fs)
  */
 _INLINE_ int ext2fs_test_bb_dirty(ext2_filsys fs)
 {
-    return (fs->flags & EXT2_FLAG_BB_DIRTY);
+    return (fs->flags & (EXT2_FLAG_BB_DIRTY | EXT2_FLAG_BB_GROUP_DIRTY));
 }
 
 /*
@@ -87,6 +87,8 @@ struct ext2_inode_cache {
     unsigned int            cache_size;
     int                refcount;
     struct ext2_inode_cache_ent    *cache;
+    /* inode in buffer whose stored checksum is known to be good */
+    ext2_ino_t            buffer_csum_ino;
 };
 
 struct ext2_inode_cache_ent {
@@ -94,6 +96,23 @@ struct ext2_inode_cache_ent {
     struct ext2_inode    *inode;
 };
 
+/*
+ * Extent tree block cache structure
+ */
+struct ext2_extent_cache {
+    char *                buffer;
+    int                cache_last;
+    unsigned int            cache_size;
+    struct ext2_extent_cache_ent    *cache;
+    void *                mutex;
+};
+
+struct ext2_extent_cache_ent {
+    blk64_t            blk;
+    unsigned long long    tag;    /* EXT2_VERIFY_TAG(ino, generation) */
+    char            *buf;
+};
+
 /*
  * NLS definitions
  */
@@ -196,8 +215,114 @@ extern errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap bitmap,
 extern errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap bitmap,
                                                __u64 start, unsigned int num,
                                                void *out);
+extern int ext2fs_generic_bmap_resident(ext2fs_generic_bitmap bitmap);
 extern void ext2fs_warn_bitmap32(ext2fs_generic_bitmap bitmap,const char *func);
 
+/*
+ * Tag under which the I/O cache remembers that a metadata block passed
+ * its checksum (see io_channel_read_blk64_verify()).  The owning inode
+ * and its generation are part of the tag where they seed the checksum;
+ * the verify callback itself tells the kinds of block apart.
+ */
+#define EXT2_VERIFY_TAG(ino, gen) \
+    (((unsigned long long) (gen) << 32) | (ino))
+
+/* Passed to the io_verify_func callbacks */
+struct ext2_verify_ctx {
+    ext2_filsys        fs;
+    ext2_ino_t        ino;
+    blk64_t            blk;
+};
+
+/* closefs.c */
+
+/*
+ * What ext2fs_flush2() last wrote to the backup superblocks and to the
+ * group descriptor blocks, so that unchanged copies can be skipped.
+ */
+struct ext2_flush_state {
+    struct ext2_super_block    super;
+    int                super_valid;
+    blk64_t            desc_blocks;
+    char            *desc;        /* NULL if not known */
+};
+
+extern void ext2fs_flush_state_release(ext2_filsys fs);
+
+/*
+ * Groups holding a backup superblock, so that ext2fs_bg_has_super()
+ * need not work it out each time.  It remembers the superblock fields
+ * it was built from and is ignored once they change.
+ */
+struct ext2_group_layout {
+    dgrp_t            group_count;
+    __u32            features;    /* sparse_super, sparse_super2 */
+    __u32            backup_bgs[2];
+    unsigned char        *has_super;    /* one bit per group */
+    dgrp_t            *super_groups;    /* the same groups, ascending */
+    dgrp_t            num_super;
+};
+
+extern errcode_t ext2fs_update_group_layout(ext2_filsys fs);
+extern void ext2fs_free_group_layout(ext2_filsys fs);
+
+/* csum.c */
+extern int ext2fs_inode_csum_matches(ext2_filsys fs, ext2_ino_t inum,
+                                     struct ext2_inode_large *inode);
+extern int ext2fs_inode_csum_update(ext2_filsys fs,
+                                    struct ext2_inode_large *inode,
+                                    const struct ext2_inode_large *old);
+
+/* dedup.c */
+extern errcode_t ext2fs_dedup_create(ext2_filsys fs);
+extern void ext2fs_dedup_free(ext2_filsys fs);
+extern blk64_t ext2fs_dedup_find(ext2_filsys fs, const void *data,
+                                 const unsigned char *sha);
+extern void ext2fs_dedup_add(ext2_filsys fs, const unsigned char *sha,
+                             blk64_t blk);
+
+/* extent.c */
+extern errcode_t ext2fs_create_extent_cache(ext2_filsys fs);
+
+/* fileio.c */
+extern void ext2fs_file_release_prealloc(ext2_filsys fs);
+extern errcode_t ext2fs_file_flush_delalloc(ext2_filsys fs);
+
+/* freeext.c */
+extern errcode_t ext2fs_free_extents_search(ext2_filsys fs, int flags,
+                                            blk64_t goal, blk64_t len,
+                                            blk64_t *pblk, blk64_t *plen);
+extern void ext2fs_free_extents_update(ext2_filsys fs, blk64_t blk,
+                                       blk64_t num, int inuse);
+extern void ext2fs_free_extents_release(ext2_filsys fs);
+extern void ext2fs_free_extents_invalidate(ext2_filsys fs);
+extern errcode_t ext2fs_group_summary_search(ext2_filsys fs, int flags,
+                                             blk64_t goal, blk64_t len,
+                                             blk64_t *pblk, blk64_t *plen);
+extern void ext2fs_group_summary_update(ext2_filsys fs, blk64_t blk,
+                                        blk64_t num, int inuse);
+extern void ext2fs_group_summary_release(ext2_filsys fs);
+
+/* rw_bitmaps.c */
+
+/*
+ * Bits in fs->dirty_groups.  The bitmap bits are cleared when the
+ * bitmaps are written, the descriptor bit by ext2fs_set_gdt_csum().
+ */
+#define GROUP_BB_DIRTY    0x01
+#define GROUP_IB_DIRTY    0x02
+#define GROUP_GDT_DIRTY    0x04
+
+extern void ext2fs_mark_bb_group_dirty(ext2_filsys fs, dgrp_t group);
+extern void ext2fs_mark_ib_group_dirty(ext2_filsys fs, dgrp_t group);
+extern int ext2fs_get_num_cpus(void);
+extern void ext2fs_run_threads(void (*func)(void *), void *args, size_t size,
+                               int num);
+extern errcode_t ext2fs_mutex_create(void **mutex);
+extern void ext2fs_mutex_destroy(void *mutex);
+extern void ext2fs_mutex_lock(void *mutex);
+extern void ext2fs_mutex_unlock(void *mutex);
+
 extern int ext2fs_mem_is_zero(const char *mem, size_t len);
 
 extern int ext2fs_file_block_offset_too_big(ext2_filsys fs,
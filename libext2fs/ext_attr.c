@@ -22,7 +22,7 @@
 #include "ext2_ext_attr.h"
 #include "ext4_acl.h"
 
-#include "ext2fs.h"
+#include "ext2fsP.h"
 
 static errcode_t read_ea_inode_hash(ext2_filsys fs, ext2_ino_t ino, __u32 *hash)
 {
@@ -212,19 +212,32 @@ static errcode_t check_ext_attr_header(struct ext2_ext_attr_header *header)
 	return 0;
 }
 
+static int ext_attr_block_verify(void *buf, void *priv)
+{
+	struct ext2_verify_ctx *ctx = priv;
+
+	return ext2fs_ext_attr_block_csum_verify(ctx->fs, ctx->ino, ctx->blk,
+						 buf);
+}
+
 errcode_t ext2fs_read_ext_attr3(ext2_filsys fs, blk64_t block, void *buf,
 				ext2_ino_t inum)
 {
-	int		csum_failed = 0;
+	struct ext2_verify_ctx ctx = { fs, inum, block };
+	int		verified = 1;
+	int		csum_failed;
 	errcode_t	retval;
 
-	retval = io_channel_read_blk64(fs->io, block, 1, buf);
+	/* The checksum is seeded by the block number, not the inode */
+	if (fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)
+		retval = io_channel_read_blk64(fs->io, block, 1, buf);
+	else
+		retval = io_channel_read_blk64_verify(fs->io, block, buf,
+				EXT2_VERIFY_TAG(0, 0),
+				ext_attr_block_verify, &ctx, &verified);
 	if (retval)
 		return retval;
-
-	if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-	    !ext2fs_ext_attr_block_csum_verify(fs, inum, block, buf))
-		csum_failed = 1;
+	csum_failed = !verified;
 
 #ifdef WORDS_BIGENDIAN
 	ext2fs_swap_ext_attr(buf, buf, fs->blocksize, 1);
@@ -181,6 +181,157 @@ errcode_t ext2fs_extent_header_verify(void *ptr, int size)
 }
 
 
+/*
+ * Cache of extent tree blocks which have passed the header and checksum
+ * checks, keyed by physical block.  Blocks written through the extent
+ * code are stored back into the cache, and freed blocks are dropped.
+ * The cache is created when the file system is opened and is shared by
+ * every thread using it, so it is only touched under its mutex.
+ */
+#define EXTENT_CACHE_SIZE	16
+
+errcode_t ext2fs_create_extent_cache(ext2_filsys fs)
+{
+	struct ext2_extent_cache *ecache;
+	unsigned int	i;
+	errcode_t	retval;
+
+	if (fs->ecache)
+		return 0;
+	retval = ext2fs_get_memzero(sizeof(struct ext2_extent_cache), &ecache);
+	if (retval)
+		return retval;
+	retval = ext2fs_get_array(EXTENT_CACHE_SIZE, fs->blocksize,
+				  &ecache->buffer);
+	if (retval)
+		goto errout;
+	retval = ext2fs_get_array(EXTENT_CACHE_SIZE,
+				  sizeof(struct ext2_extent_cache_ent),
+				  &ecache->cache);
+	if (retval)
+		goto errout;
+	retval = ext2fs_mutex_create(&ecache->mutex);
+	if (retval)
+		goto errout;
+	for (i = 0; i < EXTENT_CACHE_SIZE; i++) {
+		ecache->cache[i].blk = 0;
+		ecache->cache[i].tag = 0;
+		ecache->cache[i].buf = ecache->buffer + i * fs->blocksize;
+	}
+	ecache->cache_last = -1;
+	ecache->cache_size = EXTENT_CACHE_SIZE;
+	fs->ecache = ecache;
+	return 0;
+errout:
+	if (ecache->cache)
+		ext2fs_free_mem(&ecache->cache);
+	if (ecache->buffer)
+		ext2fs_free_mem(&ecache->buffer);
+	ext2fs_free_mem(&ecache);
+	return retval;
+}
+
+void ext2fs_free_extent_cache(ext2_filsys fs)
+{
+	struct ext2_extent_cache *ecache = fs->ecache;
+
+	if (!ecache)
+		return;
+	if (ecache->buffer)
+		ext2fs_free_mem(&ecache->buffer);
+	if (ecache->cache)
+		ext2fs_free_mem(&ecache->cache);
+	if (ecache->mutex)
+		ext2fs_mutex_destroy(ecache->mutex);
+	ext2fs_free_mem(&ecache);
+	fs->ecache = 0;
+}
+
+/* Called with the cache mutex held */
+static struct ext2_extent_cache_ent *extent_cache_find(ext2_filsys fs,
+						       blk64_t blk)
+{
+	unsigned int	i;
+
+	for (i = 0; i < fs->ecache->cache_size; i++) {
+		if (fs->ecache->cache[i].blk == blk)
+			return &fs->ecache->cache[i];
+	}
+	return NULL;
+}
+
+/*
+ * Entries are tagged with the inode number and generation, which both
+ * seed the checksum, so that a block is not taken as verified for an
+ * inode that has since been freed and reused.
+ */
+#define EXTENT_CACHE_TAG(handle) \
+	EXT2_VERIFY_TAG((handle)->ino, (handle)->inode->i_generation)
+
+/*
+ * Return non-zero and copy the block into buf if blk is cached on
+ * behalf of the same inode.
+ */
+static int extent_cache_lookup(ext2_extent_handle_t handle, blk64_t blk,
+			       void *buf)
+{
+	ext2_filsys	fs = handle->fs;
+	struct ext2_extent_cache_ent *ent;
+	int		found = 0;
+
+	if (!fs->ecache || !blk)
+		return 0;
+	ext2fs_mutex_lock(fs->ecache->mutex);
+	ent = extent_cache_find(fs, blk);
+	if (ent && ent->tag == EXTENT_CACHE_TAG(handle)) {
+		memcpy(buf, ent->buf, fs->blocksize);
+		found = 1;
+	}
+	ext2fs_mutex_unlock(fs->ecache->mutex);
+	return found;
+}
+
+static void extent_cache_store(ext2_extent_handle_t handle, blk64_t blk,
+			       const void *buf)
+{
+	ext2_filsys	fs = handle->fs;
+	struct ext2_extent_cache_ent *ent;
+
+	if (!fs->ecache || !blk)
+		return;
+	ext2fs_mutex_lock(fs->ecache->mutex);
+	ent = extent_cache_find(fs, blk);
+	if (!ent) {
+		fs->ecache->cache_last = (fs->ecache->cache_last + 1) %
+			fs->ecache->cache_size;
+		ent = &fs->ecache->cache[fs->ecache->cache_last];
+	}
+	ent->blk = blk;
+	ent->tag = EXTENT_CACHE_TAG(handle);
+	memcpy(ent->buf, buf, fs->blocksize);
+	ext2fs_mutex_unlock(fs->ecache->mutex);
+}
+
+static int extent_block_verify(void *buf, void *priv)
+{
+	struct ext2_verify_ctx *ctx = priv;
+
+	return ext2fs_extent_block_csum_verify(ctx->fs, ctx->ino, buf);
+}
+
+static void extent_cache_invalidate(ext2_filsys fs, blk64_t blk)
+{
+	struct ext2_extent_cache_ent *ent;
+
+	if (!fs->ecache || !blk)
+		return;
+	ext2fs_mutex_lock(fs->ecache->mutex);
+	ent = extent_cache_find(fs, blk);
+	if (ent)
+		ent->blk = 0;
+	ext2fs_mutex_unlock(fs->ecache->mutex);
+}
+
 /*
  * Begin functions to handle an inode's extent information
  */
@@ -310,6 +461,7 @@ errcode_t ext2fs_extent_get(ext2_extent_handle_t handle,
 	blk64_t				end_blk;
 	int				orig_op, op, l;
 	int				failed_csum = 0;
+	int				cached, verified = 1;
 
 	EXT2_CHECK_MAGIC(handle, EXT2_ET_MAGIC_EXTENT_HANDLE);
 
@@ -468,12 +620,29 @@ retry:
 				return EXT2_ET_EXTENT_CYCLE;
 		}
 		newpath->blk = blk;
+		cached = 0;
 		if ((handle->fs->flags & EXT2_FLAG_IMAGE_FILE) &&
-		    (handle->fs->io != handle->fs->image_io))
+		    (handle->fs->io != handle->fs->image_io)) {
 			memset(newpath->buf, 0, handle->fs->blocksize);
+			verified = ext2fs_extent_block_csum_verify(handle->fs,
+					handle->ino,
+					(struct ext3_extent_header *)
+					newpath->buf);
+		} else if (extent_cache_lookup(handle, blk, newpath->buf))
+			cached = 1;
 		else {
-			retval = io_channel_read_blk64(handle->fs->io,
+			struct ext2_verify_ctx ctx = { handle->fs,
+						       handle->ino, blk };
+
+			if (handle->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)
+				retval = io_channel_read_blk64(handle->fs->io,
 						     blk, 1, newpath->buf);
+			else
+				retval = io_channel_read_blk64_verify(
+					handle->fs->io, blk, newpath->buf,
+					EXT2_VERIFY_TAG(handle->ino,
+						handle->inode->i_generation),
+					extent_block_verify, &ctx, &verified);
 			if (retval)
 				return retval;
 		}
@@ -481,16 +650,23 @@ retry:
 
 		eh = (struct ext3_extent_header *) newpath->buf;
 
-		retval = ext2fs_extent_header_verify(eh, handle->fs->blocksize);
-		if (retval) {
-			handle->level--;
-			return retval;
-		}
+		if (!cached) {
+			retval = ext2fs_extent_header_verify(eh,
+						handle->fs->blocksize);
+			if (retval) {
+				handle->level--;
+				return retval;
+			}
 
-		if (!(handle->fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-		    !ext2fs_extent_block_csum_verify(handle->fs, handle->ino,
-						     eh))
-			failed_csum = 1;
+			if (!(handle->fs->flags &
+			      EXT2_FLAG_IGNORE_CSUM_ERRORS)) {
+				if (verified)
+					extent_cache_store(handle, blk,
+							   newpath->buf);
+				else
+					failed_csum = 1;
+			}
+		}
 
 		newpath->left = newpath->entries =
 			ext2fs_le16_to_cpu(eh->eh_entries);
@@ -605,6 +781,11 @@ static errcode_t update_path(ext2_extent_handle_t handle)
 
 		retval = io_channel_write_blk64(handle->fs->io,
 				      blk, 1, handle->path[handle->level].buf);
+		if (retval)
+			extent_cache_invalidate(handle->fs, blk);
+		else
+			extent_cache_store(handle, blk,
+					   handle->path[handle->level].buf);
 	}
 	return retval;
 }
@@ -1072,8 +1253,11 @@ static errcode_t extent_node_split(ext2_extent_handle_t handle,
 	retval = io_channel_write_blk64(handle->fs->io, new_node_pblk, 1,
 					block_buf);
 
-	if (retval)
+	if (retval) {
+		extent_cache_invalidate(handle->fs, new_node_pblk);
 		goto done;
+	}
+	extent_cache_store(handle, new_node_pblk, block_buf);
 
 	/* OK! we've created the new node; now adjust the tree */
 
@@ -1599,6 +1783,219 @@ done:
 	return retval;
 }
 
+/*
+ * Maps the physical blocks pblk..pblk+len-1 at logical blocks
+ * lblk..lblk+len-1 in one call.
+ *
+ * The range is merged into the extents on either side of it when they
+ * are physically contiguous, and otherwise added as a single extent, so
+ * that the tree (and the checksums of the nodes involved) is updated
+ * once per range instead of once per block.  If part of the range is
+ * already mapped, fall back to remapping it block by block.
+ */
+static errcode_t extent_set_bmap_range(ext2_extent_handle_t handle,
+				       blk64_t lblk, blk64_t pblk,
+				       blk64_t len, int flags)
+{
+	errcode_t		retval;
+	int			new_uninit = 0;
+	int			max_len = EXT_INIT_MAX_LEN;
+	int			has_prev = 0, has_next = 0;
+	struct extent_path	*path;
+	struct ext2fs_extent	extent, prev_extent, next_extent;
+	struct ext2fs_extent	newextent;
+	blk64_t			i;
+
+	path = handle->path + handle->level;
+
+	if (flags & EXT2_EXTENT_SET_BMAP_UNINIT) {
+		new_uninit = 1;
+		max_len = EXT_UNINIT_MAX_LEN;
+	}
+
+	newextent.e_lblk = lblk;
+	newextent.e_pblk = pblk;
+	newextent.e_len = len;
+	newextent.e_flags = EXT2_EXTENT_FLAGS_LEAF;
+	if (new_uninit)
+		newextent.e_flags |= EXT2_EXTENT_FLAGS_UNINIT;
+
+	/* special case if the extent tree is completely empty */
+	if ((handle->max_depth == 0) && (path->entries == 0))
+		return ext2fs_extent_insert(handle, 0, &newextent);
+
+	retval = ext2fs_extent_goto(handle, lblk);
+	if (retval == 0)
+		goto slow_path;
+	if (retval != EXT2_ET_EXTENT_NOT_FOUND)
+		return retval;
+
+	/*
+	 * The handle now points at the last extent before lblk, or at
+	 * the first extent of the file if lblk lies before all of them.
+	 */
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	if (retval)
+		return retval;
+	if (extent.e_lblk > lblk) {
+		next_extent = extent;
+		has_next = 1;
+	} else {
+		prev_extent = extent;
+		has_prev = 1;
+		retval = ext2fs_extent_get(handle, EXT2_EXTENT_NEXT_LEAF,
+					   &next_extent);
+		if (retval == 0)
+			has_next = 1;
+		else if (retval != EXT2_ET_EXTENT_NO_NEXT)
+			return retval;
+	}
+	if (has_next && next_extent.e_lblk < lblk + len)
+		goto slow_path;
+
+	/* Do not merge with extents of a different initialized state */
+	if (has_prev &&
+	    (!!(prev_extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) != new_uninit ||
+	     prev_extent.e_lblk + prev_extent.e_len != lblk ||
+	     prev_extent.e_pblk + prev_extent.e_len != pblk ||
+	     prev_extent.e_len + len > (blk64_t) max_len))
+		has_prev = 0;
+	if (has_next &&
+	    (!!(next_extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT) != new_uninit ||
+	     next_extent.e_lblk != lblk + len ||
+	     next_extent.e_pblk != pblk + len ||
+	     next_extent.e_len + len > (blk64_t) max_len))
+		has_next = 0;
+	if (has_prev && has_next &&
+	    prev_extent.e_len + len + next_extent.e_len > (blk64_t) max_len)
+		has_next = 0;
+
+	if (has_prev) {
+		if (has_next) {
+			/* The range fills a hole; fold the next extent in */
+			retval = ext2fs_extent_goto(handle,
+						    next_extent.e_lblk);
+			if (retval)
+				return retval;
+			retval = ext2fs_extent_delete(handle, 0);
+			if (retval)
+				return retval;
+			retval = ext2fs_extent_fix_parents(handle);
+			if (retval && retval != EXT2_ET_NO_CURRENT_NODE)
+				return retval;
+			prev_extent.e_len += next_extent.e_len;
+		}
+
+		/* Grow the previous extent; its start does not move */
+		retval = ext2fs_extent_goto(handle, prev_extent.e_lblk);
+		if (retval)
+			return retval;
+		prev_extent.e_len += len;
+		return ext2fs_extent_replace(handle, 0, &prev_extent);
+	}
+
+	if (has_next) {
+		/* Grow the next extent downwards */
+		retval = ext2fs_extent_goto(handle, next_extent.e_lblk);
+		if (retval)
+			return retval;
+		next_extent.e_lblk = lblk;
+		next_extent.e_pblk = pblk;
+		next_extent.e_len += len;
+		retval = ext2fs_extent_replace(handle, 0, &next_extent);
+		if (retval)
+			return retval;
+		return ext2fs_extent_fix_parents(handle);
+	}
+
+	retval = ext2fs_extent_goto(handle, lblk);
+	if (retval && retval != EXT2_ET_EXTENT_NOT_FOUND)
+		return retval;
+	retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT, &extent);
+	if (retval)
+		return retval;
+	if (lblk < extent.e_lblk)
+		retval = ext2fs_extent_insert(handle, 0, &newextent);
+	else
+		retval = ext2fs_extent_insert(handle,
+					      EXT2_EXTENT_INSERT_AFTER,
+					      &newextent);
+	if (retval)
+		return retval;
+	return ext2fs_extent_fix_parents(handle);
+
+slow_path:
+	for (i = 0; i < len; i++) {
+		retval = ext2fs_extent_set_bmap(handle, lblk + i, pblk + i,
+						flags);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+errcode_t ext2fs_extent_set_bmap_range(ext2_extent_handle_t handle,
+				       blk64_t lblk, blk64_t pblk,
+				       blk64_t len, int flags)
+{
+	errcode_t		retval = 0;
+	int			orig_height;
+	blk64_t			orig_lblk, max_len, n;
+	struct ext2fs_extent	extent;
+	struct ext2_extent_info	info;
+
+	EXT2_CHECK_MAGIC(handle, EXT2_ET_MAGIC_EXTENT_HANDLE);
+
+#ifdef DEBUG
+	printf("set_bmap_range ino %u log %llu phys %llu len %llu flags %d\n",
+	       handle->ino, lblk, pblk, len, flags);
+#endif
+
+	if (!(handle->fs->flags & EXT2_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	if (!handle->path)
+		return EXT2_ET_NO_CURRENT_NODE;
+
+	if (!pblk || !len)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	if (lblk + len - 1 > EXT_MAX_EXTENT_LBLK ||
+	    pblk + len - 1 > EXT_MAX_EXTENT_PBLK)
+		return EXT2_ET_EXTENT_INVALID_LENGTH;
+
+	max_len = (flags & EXT2_EXTENT_SET_BMAP_UNINIT) ?
+		EXT_UNINIT_MAX_LEN : EXT_INIT_MAX_LEN;
+
+	/* save our original location in the extent tree */
+	if ((retval = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
+					&extent))) {
+		if (retval != EXT2_ET_NO_CURRENT_NODE)
+			return retval;
+		memset(&extent, 0, sizeof(extent));
+	}
+	if ((retval = ext2fs_extent_get_info(handle, &info)))
+		return retval;
+	orig_height = info.max_depth - info.curr_level;
+	orig_lblk = extent.e_lblk;
+
+	while (len) {
+		n = len < max_len ? len : max_len;
+		retval = extent_set_bmap_range(handle, lblk, pblk, n, flags);
+		if (retval)
+			break;
+		lblk += n;
+		pblk += n;
+		len -= n;
+	}
+
+	/* get handle back to its position */
+	if (orig_height > handle->max_depth)
+		orig_height = handle->max_depth;
+	ext2fs_extent_goto2(handle, orig_height, orig_lblk);
+	return retval;
+}
+
 errcode_t ext2fs_extent_delete(ext2_extent_handle_t handle, int flags)
 {
 	struct extent_path		*path;
@@ -1665,6 +2062,7 @@ errcode_t ext2fs_extent_delete(ext2_extent_handle_t handle, int flags)
 				 EXT2FS_CLUSTER_RATIO(handle->fs)) / 512;
 			retval = ext2fs_write_inode(handle->fs, handle->ino,
 						    handle->inode);
+			extent_cache_invalidate(handle->fs, extent.e_pblk);
 			ext2fs_block_alloc_stats2(handle->fs,
 						  extent.e_pblk, -1);
 		}
@@ -604,25 +604,10 @@ no_implied:
 		newex.e_pblk = pblk + cluster_fill;
 		newex.e_len = plen - cluster_fill;
 		dbg_print_extent("ext_falloc create", &newex);
-		ext2fs_extent_goto(handle, newex.e_lblk);
-		err = ext2fs_extent_get(handle, EXT2_EXTENT_CURRENT,
-					&ex);
-		if (err == EXT2_ET_NO_CURRENT_NODE)
-			ex.e_lblk = 0;
-		else if (err)
-			goto out;
-
-		if (ex.e_lblk > newex.e_lblk)
-			op = 0; /* insert before */
-		else
-			op = EXT2_EXTENT_INSERT_AFTER;
-		dbg_printf("%s: inserting %s lblk %llu newex=%llu\n",
-			   __func__, op ? "after" : "before", ex.e_lblk,
-			   newex.e_lblk);
-		err = ext2fs_extent_insert(handle, op, &newex);
-		if (err)
-			goto out;
-		err = ext2fs_extent_fix_parents(handle);
+		err = ext2fs_extent_set_bmap_range(handle, newex.e_lblk,
+				newex.e_pblk, newex.e_len,
+				(newex.e_flags & EXT2_EXTENT_FLAGS_UNINIT) ?
+				EXT2_EXTENT_SET_BMAP_UNINIT : 0);
 		if (err)
 			goto out;
 
@@ -29,13 +29,32 @@ struct ext2_file {
 	blk64_t			blockno;
 	blk64_t			physblock;
 	char 			*buf;
+	blk64_t			da_lblk;
+	blk64_t			da_count;
+	char			*da_buf;
+	struct ext2_file	*da_next;
+	int			da_linked;
+	blk64_t			map_lblk;
+	blk64_t			map_count;
+	blk64_t			*map;
+	blk64_t			pa_lblk;
+	blk64_t			pa_pblk;
+	blk64_t			pa_len;
+	struct ext2_file	*pa_next;
+	int			pa_linked;
 };
 
-struct block_entry {
-	blk64_t		physblock;
-	unsigned char 	sha[EXT2FS_SHA512_LENGTH];
-};
-typedef struct block_entry *block_entry_t;
+/*
+ * Maximum number of dirty blocks held back for delayed allocation
+ * before they are forced out to disk.
+ */
+#define DELALLOC_MAX_BLOCKS	32
+
+/*
+ * Number of blocks reserved at a time for a file which is appended to
+ * without delayed allocation.
+ */
+#define PREALLOC_BLOCKS		32
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
 
@@ -121,17 +140,367 @@ ext2_ino_t ext2fs_file_get_inode_num(ext2_file_t file)
 }
 
 /*
- * This function flushes the dirty block buffer out to disk if
- * necessary.
+ * Block-mapped files keep a window of the mappings read from the last
+ * indirect block looked at, so that sequential access costs one walk
+ * of the indirect tree per indirect block instead of one per data
+ * block.  The window never extends past EOF and is dropped whenever
+ * the size changes.
  */
-errcode_t ext2fs_file_flush(ext2_file_t file)
+static errcode_t file_bmap(ext2_file_t file, blk64_t blk, int *ret_flags,
+			   blk64_t *phys_blk)
+{
+	ext2_filsys	fs = file->fs;
+	blk64_t		count, last;
+	errcode_t	retval;
+
+	if (file->inode.i_flags & (EXT4_EXTENTS_FL | EXT4_INLINE_DATA_FL))
+		return ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
+				    0, blk, ret_flags, phys_blk);
+
+	if (ret_flags)
+		*ret_flags = 0;
+	if (file->map_count && blk >= file->map_lblk &&
+	    blk < file->map_lblk + file->map_count) {
+		*phys_blk = file->map[blk - file->map_lblk];
+		return 0;
+	}
+
+	last = (EXT2_I_SIZE(&file->inode) + fs->blocksize - 1) /
+		fs->blocksize;
+	if (blk >= last)
+		return ext2fs_bmap2(fs, file->ino, &file->inode, BMAP_BUFFER,
+				    0, blk, ret_flags, phys_blk);
+
+	if (!file->map) {
+		retval = ext2fs_get_array(fs->blocksize >> 2, sizeof(blk64_t),
+					  &file->map);
+		if (retval)
+			return retval;
+	}
+	count = fs->blocksize >> 2;
+	if (count > last - blk)
+		count = last - blk;
+	file->map_count = 0;
+	retval = ext2fs_bmap_range(fs, file->ino, &file->inode, BMAP_BUFFER,
+				   blk, count, file->map, &count);
+	if (retval)
+		return retval;
+	file->map_lblk = blk;
+	file->map_count = count;
+	*phys_blk = file->map[0];
+	return 0;
+}
+
+/*
+ * Record a new mapping for blk in the window, if it is covered.
+ */
+static void file_map_update(ext2_file_t file, blk64_t blk, blk64_t phys_blk)
+{
+	if (file->map_count && blk >= file->map_lblk &&
+	    blk < file->map_lblk + file->map_count)
+		file->map[blk - file->map_lblk] = phys_blk;
+}
+
+/*
+ * Delayed allocation.  Blocks written into holes of an extent-mapped
+ * file are not given a physical block when they are dirtied; they are
+ * collected into a run of logically contiguous blocks which is
+ * allocated with a single ext2fs_new_range() call and mapped with a
+ * single extent when the run is flushed.  Files with a pending run are
+ * kept on fs->delalloc_files so that ext2fs_flush() can write them out.
+ */
+static int file_can_delalloc(ext2_file_t file)
+{
+	ext2_filsys fs = file->fs;
+
+	return file->ino && (file->inode.i_flags & EXT4_EXTENTS_FL) &&
+		!(fs->flags & EXT2_FLAG_SHARE_DUP) &&
+		EXT2FS_CLUSTER_RATIO(fs) == 1;
+}
+
+/*
+ * Returns a pointer to the held-back data for logical block blk, or
+ * NULL if that block is not part of the pending run.
+ */
+static char *delalloc_lookup(ext2_file_t file, blk64_t blk)
+{
+	if (!file->da_count || blk < file->da_lblk ||
+	    blk >= file->da_lblk + file->da_count)
+		return NULL;
+	return file->da_buf + (blk - file->da_lblk) * file->fs->blocksize;
+}
+
+/*
+ * Map the physical range pblk..pblk+len-1 at logical block lblk.
+ */
+static errcode_t delalloc_map_range(ext2_file_t file, blk64_t lblk,
+				    blk64_t pblk, blk64_t len)
+{
+	ext2_extent_handle_t	handle;
+	errcode_t		retval;
+
+	retval = ext2fs_extent_open2(file->fs, file->ino, &file->inode,
+				     &handle);
+	if (retval)
+		return retval;
+	retval = ext2fs_extent_set_bmap_range(handle, lblk, pblk, len, 0);
+	ext2fs_extent_free(handle);
+	return retval;
+}
+
+/*
+ * Allocate, write and map the pending delayed allocation run.  On
+ * failure the blocks which could not be written stay pending.
+ */
+static errcode_t delalloc_flush(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	blk64_t		lblk = file->da_lblk;
+	blk64_t		left = file->da_count;
+	blk64_t		goal = 0, pblk, plen;
+	char		*ptr = file->da_buf;
+	errcode_t	retval = 0;
+
+	if (!left)
+		return 0;
+
+	if (lblk) {
+		retval = ext2fs_bmap2(fs, file->ino, &file->inode, NULL, 0,
+				      lblk - 1, 0, &goal);
+		if (retval == 0 && goal)
+			goal++;
+	}
+	if (!goal)
+		goal = ext2fs_find_inode_goal(fs, file->ino, &file->inode,
+					      lblk);
+
+	while (left) {
+		retval = ext2fs_new_range(fs, 0, goal, left, NULL,
+					  &pblk, &plen);
+		if (retval)
+			break;
+		if (plen > left)
+			plen = left;
+
+		retval = io_channel_write_blk64(fs->io, pblk, plen, ptr);
+		if (retval)
+			break;
+
+		ext2fs_block_alloc_stats_range(fs, pblk, plen, +1);
+		retval = delalloc_map_range(file, lblk, pblk, plen);
+		if (retval) {
+			ext2fs_block_alloc_stats_range(fs, pblk, plen, -1);
+			break;
+		}
+		ext2fs_iblk_add_blocks(fs, &file->inode, plen);
+		retval = ext2fs_write_inode(fs, file->ino, &file->inode);
+		if (retval)
+			break;
+
+		if ((file->flags & EXT2_FILE_BUF_VALID) &&
+		    file->blockno >= lblk && file->blockno < lblk + plen)
+			file->physblock = pblk + (file->blockno - lblk);
+
+		lblk += plen;
+		left -= plen;
+		ptr += plen * fs->blocksize;
+		goal = pblk + plen;
+	}
+
+	if (left && ptr != file->da_buf)
+		memmove(file->da_buf, ptr, left * fs->blocksize);
+	file->da_lblk = lblk;
+	file->da_count = left;
+	return retval;
+}
+
+/*
+ * Hold back the dirty block buffer as part of the pending run,
+ * flushing the run first if the buffer cannot be appended to it.
+ */
+static errcode_t delalloc_add(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	char		*ptr;
+	errcode_t	retval;
+
+	ptr = delalloc_lookup(file, file->blockno);
+	if (ptr)
+		goto copy;
+
+	if (file->da_count &&
+	    (file->blockno != file->da_lblk + file->da_count ||
+	     file->da_count >= DELALLOC_MAX_BLOCKS)) {
+		retval = delalloc_flush(file);
+		if (retval)
+			return retval;
+	}
+	if (!file->da_buf) {
+		retval = ext2fs_get_array(DELALLOC_MAX_BLOCKS, fs->blocksize,
+					  &file->da_buf);
+		if (retval)
+			return retval;
+	}
+	if (!file->da_count)
+		file->da_lblk = file->blockno;
+	if (!file->da_linked) {
+		file->da_next = fs->delalloc_files;
+		fs->delalloc_files = file;
+		file->da_linked = 1;
+	}
+	ptr = file->da_buf + file->da_count * fs->blocksize;
+	file->da_count++;
+copy:
+	memcpy(ptr, file->buf, fs->blocksize);
+	return 0;
+}
+
+static void delalloc_unlink(ext2_file_t file)
+{
+	ext2_file_t	*pp;
+
+	if (!file->da_linked)
+		return;
+	for (pp = &file->fs->delalloc_files; *pp; pp = &(*pp)->da_next) {
+		if (*pp == file) {
+			*pp = file->da_next;
+			break;
+		}
+	}
+	file->da_linked = 0;
+}
+
+/*
+ * Preallocation.  Block-mapped files cannot use delayed allocation and
+ * get their blocks one at a time as they are written.  So that a file
+ * which is being appended to stays contiguous while other files grow
+ * at the same time, it reserves a window of PREALLOC_BLOCKS blocks
+ * near its goal and takes its next blocks from there.  The unused part
+ * of the window is released when the file is closed, and by
+ * ext2fs_flush() before the bitmaps are written out, so a window never
+ * reaches disk.
+ *
+ * File systems with EXT2_FLAG_SHARE_DUP or bigalloc get no windows: a
+ * reserved block still holding old data could be handed out by the
+ * dedup index, and clusters are allocated differently.  That leaves
+ * extent-mapped files with neither delayed allocation nor windows.
+ */
+static int file_can_prealloc(ext2_file_t file)
+{
+	ext2_filsys fs = file->fs;
+
+	return file->ino && LINUX_S_ISREG(file->inode.i_mode) &&
+		!(file->inode.i_flags & EXT4_EXTENTS_FL) &&
+		!(fs->flags & EXT2_FLAG_SHARE_DUP) &&
+		EXT2FS_CLUSTER_RATIO(fs) == 1;
+}
+
+static void prealloc_release(ext2_file_t file)
+{
+	if (!file->pa_len)
+		return;
+	ext2fs_block_alloc_stats_range(file->fs, file->pa_pblk,
+				       file->pa_len, -1);
+	file->pa_len = 0;
+}
+
+static void prealloc_unlink(ext2_file_t file)
+{
+	ext2_file_t	*pp;
+
+	if (!file->pa_linked)
+		return;
+	for (pp = &file->fs->prealloc_files; *pp; pp = &(*pp)->pa_next) {
+		if (*pp == file) {
+			*pp = file->pa_next;
+			break;
+		}
+	}
+	file->pa_linked = 0;
+}
+
+/*
+ * Reserve a new window for the file, starting at the block after the
+ * one mapped just before file->blockno if possible.
+ */
+static errcode_t prealloc_reserve(ext2_file_t file)
+{
+	ext2_filsys	fs = file->fs;
+	blk64_t		goal = 0, pblk, plen;
+	errcode_t	retval;
+
+	if (file->blockno &&
+	    file_bmap(file, file->blockno - 1, NULL, &goal) == 0 && goal)
+		goal++;
+	if (!goal)
+		goal = ext2fs_find_inode_goal(fs, file->ino, &file->inode,
+					      file->blockno);
+
+	retval = ext2fs_new_range(fs, 0, goal, PREALLOC_BLOCKS, NULL,
+				  &pblk, &plen);
+	if (retval)
+		return retval;
+	if (plen > PREALLOC_BLOCKS)
+		plen = PREALLOC_BLOCKS;
+	ext2fs_block_alloc_stats_range(fs, pblk, plen, +1);
+
+	file->pa_lblk = file->blockno;
+	file->pa_pblk = pblk;
+	file->pa_len = plen;
+	if (!file->pa_linked) {
+		file->pa_next = fs->prealloc_files;
+		fs->prealloc_files = file;
+		file->pa_linked = 1;
+	}
+	return 0;
+}
+
+/*
+ * Take the block for file->blockno from the file's window.  Returns 0
+ * if the block should be allocated the usual way instead.
+ */
+static int prealloc_take(ext2_file_t file, blk64_t *pblk)
+{
+	ext2_filsys	fs = file->fs;
+
+	if (!file_can_prealloc(file))
+		return 0;
+	if (!file->pa_len || file->blockno != file->pa_lblk) {
+		/* Only start a new window when appending */
+		if (file->blockno < EXT2_I_SIZE(&file->inode) / fs->blocksize)
+			return 0;
+		prealloc_release(file);
+		if (prealloc_reserve(file))
+			return 0;
+	}
+	*pblk = file->pa_pblk++;
+	file->pa_lblk++;
+	file->pa_len--;
+	return 1;
+}
+
+/*
+ * Release the preallocation windows of all open files.
+ */
+void ext2fs_file_release_prealloc(ext2_filsys fs)
+{
+	ext2_file_t	file;
+
+	for (file = fs->prealloc_files; file; file = file->pa_next)
+		prealloc_release(file);
+}
+
+/*
+ * This function writes the dirty block buffer out to disk, or hands it
+ * to the delayed allocation run if it has no physical block yet.
+ */
+static errcode_t flush_buffer(ext2_file_t file)
 {
 	errcode_t	retval;
 	ext2_filsys fs;
 	int		ret_flags;
 	blk64_t		dontcare;
 
-	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 	fs = file->fs;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID) ||
@@ -154,6 +523,14 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 		}
 	}
 
+	if (!file->physblock && file_can_delalloc(file)) {
+		retval = delalloc_add(file);
+		if (retval)
+			return retval;
+		file->flags &= ~EXT2_FILE_BUF_DIRTY;
+		return 0;
+	}
+
 	/*
 	 * OK, the physical block hasn't been allocated yet.
 	 * Allocate it.
@@ -164,6 +541,7 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 				     file->blockno, 0, &file->physblock);
 		if (retval)
 			return retval;
+		file_map_update(file, file->blockno, file->physblock);
 	}
 
 	retval = io_channel_write_blk64(fs->io, file->physblock, 1, file->buf);
@@ -175,6 +553,40 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	return retval;
 }
 
+/*
+ * This function flushes the dirty block buffer and any blocks held
+ * back for delayed allocation out to disk if necessary.
+ */
+errcode_t ext2fs_file_flush(ext2_file_t file)
+{
+	errcode_t	retval;
+
+	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
+
+	retval = flush_buffer(file);
+	if (retval)
+		return retval;
+
+	return delalloc_flush(file);
+}
+
+/*
+ * Flush every open file with blocks held back for delayed allocation,
+ * so that they are allocated and written before the metadata is.
+ */
+errcode_t ext2fs_file_flush_delalloc(ext2_filsys fs)
+{
+	ext2_file_t	file;
+	errcode_t	retval, ret = 0;
+
+	for (file = fs->delalloc_files; file; file = file->da_next) {
+		retval = ext2fs_file_flush(file);
+		if (retval && !ret)
+			ret = retval;
+	}
+	return ret;
+}
+
 /*
  * This function synchronizes the file's block buffer and the current
  * file position, possibly invalidating block buffer if necessary
@@ -186,7 +598,7 @@ static errcode_t sync_buffer_position(ext2_file_t file)
 
 	b = file->pos / file->fs->blocksize;
 	if (b != file->blockno) {
-		retval = ext2fs_file_flush(file);
+		retval = flush_buffer(file);
 		if (retval)
 			return retval;
 		file->flags &= ~EXT2_FILE_BUF_VALID;
@@ -209,11 +621,19 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 	ext2_filsys	fs = file->fs;
 	errcode_t	retval;
 	int		ret_flags;
+	char		*ptr;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
-		retval = ext2fs_bmap2(fs, file->ino, &file->inode,
-				     BMAP_BUFFER, 0, file->blockno, &ret_flags,
-				     &file->physblock);
+		ptr = delalloc_lookup(file, file->blockno);
+		if (ptr) {
+			if (!dontfill)
+				memcpy(file->buf, ptr, fs->blocksize);
+			file->physblock = 0;
+			file->flags |= EXT2_FILE_BUF_VALID;
+			return 0;
+		}
+		retval = file_bmap(file, file->blockno, &ret_flags,
+				   &file->physblock);
 		if (retval)
 			return retval;
 		if (!dontfill) {
@@ -243,6 +663,13 @@ errcode_t ext2fs_file_close(ext2_file_t file)
 
 	if (file->buf)
 		ext2fs_free_mem(&file->buf);
+	if (file->da_buf)
+		ext2fs_free_mem(&file->da_buf);
+	if (file->map)
+		ext2fs_free_mem(&file->map);
+	prealloc_release(file);
+	prealloc_unlink(file);
+	delalloc_unlink(file);
 	ext2fs_free_mem(&file);
 
 	return retval;
@@ -389,8 +816,10 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 	errcode_t	retval = 0;
 	unsigned int	start, c, count = 0;
 	const char	*ptr = (const char *) buf;
-	block_entry_t	new_block = NULL, old_block = NULL;
+	unsigned char	sha[EXT2FS_SHA512_LENGTH];
+	blk64_t		dup_blk;
 	int		bmap_flags = 0;
+	int		taken = 0;
 
 	EXT2_CHECK_MAGIC(file, EXT2_ET_MAGIC_EXT2_FILE);
 	fs = file->fs;
@@ -431,29 +860,24 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 
 		/*
 		 * OK, the physical block hasn't been allocated yet.
-		 * Allocate it.
+		 * Allocate it, unless allocation can wait until the
+		 * buffer is flushed.
 		 */
-		if (!file->physblock) {
+		if (!file->physblock && !file_can_delalloc(file)) {
 			bmap_flags = (file->ino ? BMAP_ALLOC : 0);
+			dup_blk = 0;
 			if (fs->flags & EXT2_FLAG_SHARE_DUP) {
-				new_block = e2fsmac_malloc(sizeof(*new_block), M_ZERO);
-				if (!new_block) {
-					retval = EXT2_ET_NO_MEMORY;
-					goto fail;
-				}
 				ext2fs_sha512((const unsigned char*)file->buf,
-						fs->blocksize, new_block->sha);
-				old_block = ext2fs_hashmap_lookup(
-							fs->block_sha_map,
-							new_block->sha,
-							sizeof(new_block->sha));
+						fs->blocksize, sha);
+				dup_blk = ext2fs_dedup_find(fs, file->buf, sha);
 			}
 
-			if (old_block) {
-				file->physblock = old_block->physblock;
+			if (dup_blk) {
+				file->physblock = dup_blk;
+				bmap_flags |= BMAP_SET;
+			} else if (prealloc_take(file, &file->physblock)) {
 				bmap_flags |= BMAP_SET;
-				e2fsmac_free(new_block);
-				new_block = NULL;
+				taken = 1;
 			}
 
 			retval = ext2fs_bmap2(fs, file->ino, &file->inode,
@@ -462,22 +886,18 @@ errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
 					      file->blockno, 0,
 					      &file->physblock);
 			if (retval) {
-				e2fsmac_free(new_block);
-				new_block = NULL;
+				if (taken) {
+					ext2fs_block_alloc_stats2(fs,
+						file->physblock, -1);
+					file->physblock = 0;
+				}
 				goto fail;
 			}
+			taken = 0;
+			file_map_update(file, file->blockno, file->physblock);
 
-			if (new_block) {
-				new_block->physblock = file->physblock;
-				int ret = ext2fs_hashmap_add(fs->block_sha_map,
-						new_block, new_block->sha,
-						sizeof(new_block->sha));
-				if (ret) {
-					retval = EXT2_ET_NO_MEMORY;
-					e2fsmac_free(new_block);
-					goto fail;
-				}
-			}
+			if ((fs->flags & EXT2_FLAG_SHARE_DUP) && !dup_blk)
+				ext2fs_dedup_add(fs, sha, file->physblock);
 
 			if (bmap_flags & BMAP_SET) {
 				ext2fs_iblk_add_blocks(fs, &file->inode, 1);
@@ -583,6 +1003,13 @@ static errcode_t ext2fs_file_zero_past_offset(ext2_file_t file,
 	if (retval)
 		return retval;
 
+	/* Is the block at the end still waiting to be allocated? */
+	b = delalloc_lookup(file, offset / fs->blocksize);
+	if (b) {
+		memset(b + off, 0, fs->blocksize - off);
+		return 0;
+	}
+
 	/* Is there an initialized block at the end? */
 	retval = ext2fs_bmap2(fs, file->ino, NULL, NULL, 0,
 			      offset / fs->blocksize, &ret_flags, &blk);
@@ -636,6 +1063,7 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	retval = ext2fs_inode_size_set(file->fs, &file->inode, size);
 	if (retval)
 		return retval;
+	file->map_count = 0;
 
 	if (file->ino) {
 		retval = ext2fs_write_inode(file->fs, file->ino, &file->inode);
@@ -650,6 +1078,14 @@ errcode_t ext2fs_file_set_size2(ext2_file_t file, ext2_off64_t size)
 	if (truncate_block >= old_truncate)
 		return 0;
 
+	/* Drop held-back blocks that now lie past EOF */
+	if (file->da_count) {
+		if (file->da_lblk >= truncate_block)
+			file->da_count = 0;
+		else if (file->da_lblk + file->da_count > truncate_block)
+			file->da_count = truncate_block - file->da_lblk;
+	}
+
 	return ext2fs_punch(file->fs, file->ino, &file->inode, 0,
 			    truncate_block, ~0ULL);
 }
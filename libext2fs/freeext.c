@@ -0,0 +1,665 @@
+/*
+ * freeext.c --- in-memory indexes of free block extents
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Library
+ * General Public License, version 2.
+ * %End-Header%
+ */
+
+#include "config.h"
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <sys/unistd.h>
+#endif
+#include <sys/errno.h>
+
+#include "ext2_fs.h"
+#include "ext2fsP.h"
+#include "rbtree.h"
+
+/*
+ * The free runs of fs->block_map are kept in two red-black trees: one
+ * ordered by starting block, used to find the run nearest to the goal
+ * and to follow the block allocation statistics, and one ordered by
+ * length, used for best-fit lookups.  The index is built the first
+ * time it is needed.  It is only a hint: every run it hands out is
+ * checked against the bitmap, and ext2fs_new_range() falls back to
+ * scanning the bitmap when the index has nothing suitable.
+ */
+
+/* Give up on the index rather than let it grow without bound */
+#define FREE_EXTENTS_MAX	65536
+
+/* Runs past the goal looked at before falling back to best fit */
+#define FREE_EXTENTS_NEAR	8
+
+/* Times a stale run is resynced from the bitmap before giving up */
+#define FREE_EXTENTS_RETRY	4
+
+struct free_extent {
+	struct rb_node	by_start;
+	struct rb_node	by_len;
+	blk64_t		start;
+	blk64_t		len;
+};
+
+struct ext2_free_extents {
+	ext2fs_block_bitmap	map;	/* the bitmap indexed, if valid */
+	struct rb_root		by_start;
+	struct rb_root		by_len;
+	unsigned int		count;
+	int			valid;
+	int			disabled;
+};
+
+#define start_to_extent(n) ext2fs_rb_entry(n, struct free_extent, by_start)
+#define len_to_extent(n) ext2fs_rb_entry(n, struct free_extent, by_len)
+
+static void insert_by_start(struct ext2_free_extents *idx,
+			    struct free_extent *fe)
+{
+	struct rb_node	**n = &idx->by_start.rb_node;
+	struct rb_node	*parent = NULL;
+
+	while (*n) {
+		parent = *n;
+		if (fe->start < start_to_extent(parent)->start)
+			n = &(*n)->rb_left;
+		else
+			n = &(*n)->rb_right;
+	}
+	ext2fs_rb_link_node(&fe->by_start, parent, n);
+	ext2fs_rb_insert_color(&fe->by_start, &idx->by_start);
+}
+
+static void insert_by_len(struct ext2_free_extents *idx,
+			  struct free_extent *fe)
+{
+	struct rb_node	**n = &idx->by_len.rb_node;
+	struct rb_node	*parent = NULL;
+	struct free_extent *p;
+
+	while (*n) {
+		parent = *n;
+		p = len_to_extent(parent);
+		if (fe->len < p->len ||
+		    (fe->len == p->len && fe->start < p->start))
+			n = &(*n)->rb_left;
+		else
+			n = &(*n)->rb_right;
+	}
+	ext2fs_rb_link_node(&fe->by_len, parent, n);
+	ext2fs_rb_insert_color(&fe->by_len, &idx->by_len);
+}
+
+static errcode_t index_add(struct ext2_free_extents *idx, blk64_t start,
+			   blk64_t len)
+{
+	struct free_extent *fe;
+	errcode_t	retval;
+
+	if (idx->count >= FREE_EXTENTS_MAX)
+		return EXT2_ET_NO_MEMORY;
+	retval = ext2fs_get_mem(sizeof(struct free_extent), &fe);
+	if (retval)
+		return retval;
+	fe->start = start;
+	fe->len = len;
+	insert_by_start(idx, fe);
+	insert_by_len(idx, fe);
+	idx->count++;
+	return 0;
+}
+
+static void index_remove(struct ext2_free_extents *idx,
+			 struct free_extent *fe)
+{
+	ext2fs_rb_erase(&fe->by_start, &idx->by_start);
+	ext2fs_rb_erase(&fe->by_len, &idx->by_len);
+	ext2fs_free_mem(&fe);
+	idx->count--;
+}
+
+/*
+ * Change the extent of a run.  The caller guarantees that the run does
+ * not move past its neighbours, so only the length order needs fixing.
+ */
+static void index_resize(struct ext2_free_extents *idx,
+			 struct free_extent *fe, blk64_t start, blk64_t len)
+{
+	ext2fs_rb_erase(&fe->by_len, &idx->by_len);
+	fe->start = start;
+	fe->len = len;
+	insert_by_len(idx, fe);
+}
+
+/*
+ * Return the run with the largest start not after blk, or the first
+ * run if there is none.
+ */
+static struct free_extent *index_find(struct ext2_free_extents *idx,
+				      blk64_t blk)
+{
+	struct rb_node	*n = idx->by_start.rb_node;
+	struct free_extent *fe, *found = NULL;
+
+	while (n) {
+		fe = start_to_extent(n);
+		if (fe->start <= blk) {
+			found = fe;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+	if (!found && (n = ext2fs_rb_first(&idx->by_start)))
+		found = start_to_extent(n);
+	return found;
+}
+
+static struct free_extent *index_next(struct free_extent *fe)
+{
+	struct rb_node	*n = ext2fs_rb_next(&fe->by_start);
+
+	return n ? start_to_extent(n) : NULL;
+}
+
+static void index_clear(struct ext2_free_extents *idx)
+{
+	struct rb_node	*n;
+
+	while ((n = ext2fs_rb_first(&idx->by_start)))
+		index_remove(idx, start_to_extent(n));
+}
+
+/*
+ * Drop [blk, end) from the index, trimming or splitting the runs that
+ * overlap it.
+ */
+static errcode_t index_remove_range(struct ext2_free_extents *idx,
+				    blk64_t blk, blk64_t end)
+{
+	struct free_extent *fe, *next;
+	blk64_t		fe_end;
+
+	fe = index_find(idx, blk);
+	if (fe && fe->start + fe->len <= blk)
+		fe = index_next(fe);
+	for (; fe && fe->start < end; fe = next) {
+		next = index_next(fe);
+		fe_end = fe->start + fe->len;
+		if (fe->start < blk && fe_end > end) {
+			index_resize(idx, fe, fe->start, blk - fe->start);
+			return index_add(idx, end, fe_end - end);
+		} else if (fe->start < blk)
+			index_resize(idx, fe, fe->start, blk - fe->start);
+		else if (fe_end > end)
+			index_resize(idx, fe, end, fe_end - end);
+		else
+			index_remove(idx, fe);
+	}
+	return 0;
+}
+
+/*
+ * Add [blk, end) to the index, merging it with the runs on either side.
+ */
+static errcode_t index_add_range(struct ext2_free_extents *idx,
+				 blk64_t blk, blk64_t end)
+{
+	struct free_extent *prev = NULL, *next;
+	errcode_t	retval;
+
+	retval = index_remove_range(idx, blk, end);
+	if (retval)
+		return retval;
+
+	if (blk) {
+		prev = index_find(idx, blk - 1);
+		if (prev && prev->start + prev->len != blk)
+			prev = NULL;
+	}
+	next = index_find(idx, end);
+	if (next && next->start != end)
+		next = NULL;
+
+	if (prev && next) {
+		end = next->start + next->len;
+		index_remove(idx, next);
+		index_resize(idx, prev, prev->start, end - prev->start);
+	} else if (prev)
+		index_resize(idx, prev, prev->start, end - prev->start);
+	else if (next)
+		index_resize(idx, next, blk, next->start + next->len - blk);
+	else
+		return index_add(idx, blk, end - blk);
+	return 0;
+}
+
+/*
+ * Add the free runs of the bitmap within [start, end) to the index.
+ */
+static errcode_t index_scan(struct ext2_free_extents *idx, blk64_t start,
+			    blk64_t end)
+{
+	blk64_t		run_end;
+	errcode_t	retval;
+
+	while (start < end) {
+		retval = ext2fs_find_first_zero_block_bitmap2(idx->map, start,
+							      end - 1, &start);
+		if (retval == ENOENT)
+			break;
+		if (retval)
+			return retval;
+		retval = ext2fs_find_first_set_block_bitmap2(idx->map, start,
+							     end - 1, &run_end);
+		if (retval == ENOENT)
+			run_end = end;
+		else if (retval)
+			return retval;
+		retval = index_add_range(idx, start, run_end);
+		if (retval)
+			return retval;
+		start = run_end;
+	}
+	return 0;
+}
+
+static void index_disable(struct ext2_free_extents *idx)
+{
+	index_clear(idx);
+	idx->disabled = 1;
+}
+
+/*
+ * Return the index for fs->block_map, building it if necessary, or
+ * NULL if it cannot be used.
+ */
+static struct ext2_free_extents *get_index(ext2_filsys fs)
+{
+	struct ext2_free_extents *idx = fs->free_extents;
+
+	if (!fs->block_map || EXT2FS_CLUSTER_RATIO(fs) != 1)
+		return NULL;
+	/*
+	 * Building the index reads the whole bitmap; while it is still
+	 * being read in lazily, leave allocation to the group summaries.
+	 */
+	if (!ext2fs_generic_bmap_resident(fs->block_map))
+		return NULL;
+	if (!idx) {
+		if (ext2fs_get_memzero(sizeof(struct ext2_free_extents),
+				       &idx))
+			return NULL;
+		fs->free_extents = idx;
+	}
+	if (idx->disabled)
+		return NULL;
+	if (idx->valid)
+		return idx;
+
+	index_clear(idx);
+	idx->map = fs->block_map;
+	if (index_scan(idx, fs->super->s_first_data_block,
+		       ext2fs_blocks_count(fs->super))) {
+		index_disable(idx);
+		return NULL;
+	}
+	idx->valid = 1;
+	return idx;
+}
+
+/*
+ * Bring the run containing blk back in line with the bitmap.
+ */
+static errcode_t index_resync(struct ext2_free_extents *idx, blk64_t blk)
+{
+	struct free_extent *fe = index_find(idx, blk);
+	blk64_t		start, end;
+
+	if (!fe)
+		return 0;
+	start = fe->start;
+	end = fe->start + fe->len;
+	index_remove(idx, fe);
+	return index_scan(idx, start, end);
+}
+
+/*
+ * Look for a free run for ext2fs_new_range().  Runs starting at or
+ * just after the goal are preferred; if none of them is long enough
+ * and EXT2_NEWRANGE_MIN_LENGTH is set, the shortest run that fits is
+ * used instead.  Returns ENOENT if the caller has to scan the bitmap.
+ */
+errcode_t ext2fs_free_extents_search(ext2_filsys fs, int flags,
+				     blk64_t goal, blk64_t len,
+				     blk64_t *pblk, blk64_t *plen)
+{
+	struct ext2_free_extents *idx;
+	struct free_extent *fe, *p;
+	struct rb_node	*n;
+	blk64_t		start, avail;
+	int		i, retry;
+
+	idx = get_index(fs);
+	if (!idx)
+		return ENOENT;
+
+	for (retry = 0; retry < FREE_EXTENTS_RETRY; retry++) {
+		start = avail = 0;
+		fe = index_find(idx, goal);
+		if (fe && fe->start + fe->len <= goal)
+			fe = index_next(fe);
+		for (i = 0; fe && i < FREE_EXTENTS_NEAR;
+		     i++, fe = index_next(fe)) {
+			start = fe->start < goal ? goal : fe->start;
+			avail = fe->start + fe->len - start;
+			if (!(flags & EXT2_NEWRANGE_MIN_LENGTH) ||
+			    avail >= len)
+				break;
+		}
+		if (!fe || i == FREE_EXTENTS_NEAR) {
+			fe = NULL;
+			if (flags & EXT2_NEWRANGE_MIN_LENGTH) {
+				/* Shortest run of at least len blocks */
+				n = idx->by_len.rb_node;
+				while (n) {
+					p = len_to_extent(n);
+					if (p->len >= len) {
+						fe = p;
+						n = n->rb_left;
+					} else
+						n = n->rb_right;
+				}
+			} else if ((n = ext2fs_rb_first(&idx->by_start)))
+				fe = start_to_extent(n);
+			if (!fe)
+				return ENOENT;
+			start = fe->start;
+			avail = fe->len;
+		}
+
+		if (avail > len)
+			avail = len;
+		if (ext2fs_test_block_bitmap_range2(idx->map, start, avail)) {
+			*pblk = start;
+			*plen = avail;
+			return 0;
+		}
+
+		/* Something changed the bitmap behind our back */
+		if (index_resync(idx, start)) {
+			index_disable(idx);
+			return ENOENT;
+		}
+	}
+	return ENOENT;
+}
+
+/*
+ * Called by the block allocation statistics functions whenever blocks
+ * are marked in use (inuse > 0) or released in fs->block_map.
+ */
+void ext2fs_free_extents_update(ext2_filsys fs, blk64_t blk, blk64_t num,
+				int inuse)
+{
+	struct ext2_free_extents *idx = fs->free_extents;
+	errcode_t	retval;
+
+	if (!idx || idx->disabled || !idx->valid || !num)
+		return;
+	if (inuse > 0)
+		retval = index_remove_range(idx, blk, blk + num);
+	else
+		retval = index_add_range(idx, blk, blk + num);
+	if (retval)
+		index_disable(idx);
+}
+
+void ext2fs_free_extents_release(ext2_filsys fs)
+{
+	struct ext2_free_extents *idx = fs->free_extents;
+
+	if (!idx)
+		return;
+	index_clear(idx);
+	ext2fs_free_mem(&idx);
+	fs->free_extents = NULL;
+}
+
+/*
+ * Per-group free space summaries.  For each block group we remember
+ * the number of free blocks, an upper bound on the longest free run
+ * and a lower bound on the first free block, so that the allocator
+ * can step over full groups, and groups too fragmented for the
+ * request, without looking at their bitmaps.  A summary is filled in
+ * the first time its group is scanned from the start; until then the
+ * free blocks count in the group descriptor is used to skip groups
+ * which are full.
+ */
+#define GROUP_SUMMARY_VALID	0x0001
+
+struct ext2_group_summary {
+	blk_t		free;
+	blk_t		max_run;
+	blk_t		first_free;	/* offset from the start of the group */
+	int		flags;
+};
+
+struct ext2_group_summaries {
+	ext2fs_block_bitmap	map;	/* the bitmap summarized, if valid */
+	int			valid;
+	dgrp_t			ngroups;	/* size of groups[] */
+	struct ext2_group_summary *groups;
+};
+
+static struct ext2_group_summaries *get_summaries(ext2_filsys fs)
+{
+	struct ext2_group_summaries *gs = fs->group_summaries;
+
+	if (!fs->block_map || EXT2FS_CLUSTER_RATIO(fs) != 1)
+		return NULL;
+	if (gs && gs->ngroups != fs->group_desc_count) {
+		/* The file system was resized; start over */
+		ext2fs_group_summary_release(fs);
+		gs = NULL;
+	}
+	if (!gs) {
+		if (ext2fs_get_memzero(sizeof(struct ext2_group_summaries),
+				       &gs))
+			return NULL;
+		if (ext2fs_get_arrayzero(fs->group_desc_count,
+					 sizeof(struct ext2_group_summary),
+					 &gs->groups)) {
+			ext2fs_free_mem(&gs);
+			return NULL;
+		}
+		gs->ngroups = fs->group_desc_count;
+		fs->group_summaries = gs;
+	}
+	if (!gs->valid) {
+		memset(gs->groups, 0, gs->ngroups *
+		       sizeof(struct ext2_group_summary));
+		gs->map = fs->block_map;
+		gs->valid = 1;
+	}
+	return gs;
+}
+
+/*
+ * Scan group for a free run starting at or after from.  If the whole
+ * group was scanned, its summary is brought up to date on the way.
+ */
+static int scan_group(ext2_filsys fs, struct ext2_group_summaries *gs,
+		      dgrp_t group, blk64_t from, int flags, blk64_t len,
+		      blk64_t *pblk, blk64_t *plen)
+{
+	struct ext2_group_summary *ent = &gs->groups[group];
+	blk64_t		first = ext2fs_group_first_block2(fs, group);
+	blk64_t		last = ext2fs_group_last_block2(fs, group);
+	blk64_t		max_blocks = ext2fs_blocks_count(fs->super);
+	blk64_t		start, end, run_end, b;
+	blk64_t		free = 0, max_run = 0, first_free = 0;
+	int		whole;
+
+	if ((ent->flags & GROUP_SUMMARY_VALID) &&
+	    from < first + ent->first_free)
+		from = first + ent->first_free;
+	whole = (from <= first + ((ent->flags & GROUP_SUMMARY_VALID) ?
+				  ent->first_free : 0));
+
+	for (start = from; start <= last; start = end) {
+		if (ext2fs_find_first_zero_block_bitmap2(gs->map, start,
+							 last, &start))
+			break;
+		if (ext2fs_find_first_set_block_bitmap2(gs->map, start,
+							last, &end))
+			end = last + 1;
+		if (!free)
+			first_free = start - first;
+		free += end - start;
+		if (end - start > max_run)
+			max_run = end - start;
+
+		/* A run reaching the end of the group may carry on */
+		run_end = end;
+		if (end == last + 1 && end - start < len && end < max_blocks) {
+			b = MIN(start + len - 1, max_blocks - 1);
+			if (ext2fs_find_first_set_block_bitmap2(gs->map, end, b,
+								&run_end))
+				run_end = b + 1;
+		}
+		if (run_end - start > len)
+			run_end = start + len;
+		if (!(flags & EXT2_NEWRANGE_MIN_LENGTH) ||
+		    run_end - start >= len) {
+			*pblk = start;
+			*plen = run_end - start;
+			return 1;
+		}
+	}
+
+	if (whole) {
+		ent->free = free;
+		ent->max_run = max_run;
+		ent->first_free = free ? first_free : last - first + 1;
+		ent->flags |= GROUP_SUMMARY_VALID;
+	}
+	return 0;
+}
+
+/*
+ * Look for a free run for ext2fs_new_range() or ext2fs_new_block3(),
+ * visiting the groups from the one holding the goal onwards and
+ * skipping those the summaries rule out.  Runs longer than a group
+ * and runs straddling groups the summaries rule out are not found;
+ * returns ENOENT and the caller has to scan the bitmap.
+ */
+errcode_t ext2fs_group_summary_search(ext2_filsys fs, int flags,
+				      blk64_t goal, blk64_t len,
+				      blk64_t *pblk, blk64_t *plen)
+{
+	struct ext2_group_summaries *gs;
+	struct ext2_group_summary *ent;
+	dgrp_t		group, i;
+
+	gs = get_summaries(fs);
+	if (!gs || len > EXT2_BLOCKS_PER_GROUP(fs->super))
+		return ENOENT;
+
+	group = ext2fs_group_of_blk2(fs, goal);
+	for (i = 0; i < fs->group_desc_count; i++, group++) {
+		if (group >= fs->group_desc_count)
+			group = 0;
+		ent = &gs->groups[group];
+		if (ent->flags & GROUP_SUMMARY_VALID) {
+			if (!ent->free)
+				continue;
+			if ((flags & EXT2_NEWRANGE_MIN_LENGTH) &&
+			    ent->max_run < len)
+				continue;
+		} else if (!ext2fs_bg_free_blocks_count(fs, group))
+			continue;
+		if (scan_group(fs, gs, group,
+			       i ? ext2fs_group_first_block2(fs, group) : goal,
+			       flags, len, pblk, plen))
+			return 0;
+	}
+	return ENOENT;
+}
+
+/*
+ * Called by the block allocation statistics functions whenever blocks
+ * are marked in use (inuse > 0) or released in fs->block_map.
+ */
+void ext2fs_group_summary_update(ext2_filsys fs, blk64_t blk, blk64_t num,
+				 int inuse)
+{
+	struct ext2_group_summaries *gs = fs->group_summaries;
+	struct ext2_group_summary *ent;
+	dgrp_t		group;
+	blk64_t		first, n, size;
+
+	/* Summaries left over from before a resize are rebuilt on use */
+	if (!gs || !gs->valid || gs->ngroups != fs->group_desc_count)
+		return;
+	while (num) {
+		group = ext2fs_group_of_blk2(fs, blk);
+		first = ext2fs_group_first_block2(fs, group);
+		size = ext2fs_group_last_block2(fs, group) - first + 1;
+		n = first + size - blk;
+		if (n > num)
+			n = num;
+		ent = &gs->groups[group];
+		blk += n;
+		num -= n;
+		if (!(ent->flags & GROUP_SUMMARY_VALID))
+			continue;
+		if (inuse > 0) {
+			ent->free = ent->free > n ? ent->free - n : 0;
+			if (ent->max_run > ent->free)
+				ent->max_run = ent->free;
+		} else {
+			ent->free = MIN(ent->free + n, size);
+			/* The freed blocks may join the runs on both sides */
+			ent->max_run = MIN(2 * (blk64_t) ent->max_run + n,
+					   ent->free);
+			if (blk - n - first < ent->first_free)
+				ent->first_free = blk - n - first;
+		}
+	}
+}
+
+void ext2fs_group_summary_release(ext2_filsys fs)
+{
+	struct ext2_group_summaries *gs = fs->group_summaries;
+
+	if (!gs)
+		return;
+	ext2fs_free_mem(&gs->groups);
+	ext2fs_free_mem(&gs);
+	fs->group_summaries = NULL;
+}
+
+/*
+ * Must be called whenever fs->block_map is freed or replaced.  The
+ * index and the group summaries are rebuilt from the new bitmap the
+ * next time they are used.
+ */
+void ext2fs_free_extents_invalidate(ext2_filsys fs)
+{
+	struct ext2_free_extents *idx = fs->free_extents;
+	struct ext2_group_summaries *gs = fs->group_summaries;
+
+	if (idx) {
+		index_clear(idx);
+		idx->map = NULL;
+		idx->valid = 0;
+		idx->disabled = 0;
+	}
+	if (gs) {
+		gs->map = NULL;
+		gs->valid = 0;
+	}
+}
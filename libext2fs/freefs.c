@@ -16,7 +16,6 @@
 
 #include "ext2_fs.h"
 #include "ext2fsP.h"
-#include "hashmap.h"
 
 void ext2fs_free(ext2_filsys fs)
 {
@@ -54,13 +53,25 @@ void ext2fs_free(ext2_filsys fs)
 	if (fs->icache)
 		ext2fs_free_inode_cache(fs->icache);
 
+	if (fs->ecache)
+		ext2fs_free_extent_cache(fs);
+
+	if (fs->free_extents)
+		ext2fs_free_extents_release(fs);
+	if (fs->group_summaries)
+		ext2fs_group_summary_release(fs);
+	if (fs->dirty_groups)
+		ext2fs_free_mem(&fs->dirty_groups);
+	ext2fs_flush_state_release(fs);
+	ext2fs_free_group_layout(fs);
+
 	if (fs->mmp_buf)
 		ext2fs_free_mem(&fs->mmp_buf);
 	if (fs->mmp_cmp)
 		ext2fs_free_mem(&fs->mmp_cmp);
 
-	if (fs->block_sha_map)
-		ext2fs_hashmap_free(fs->block_sha_map);
+	if (fs->dedup)
+		ext2fs_dedup_free(fs);
 
 	fs->magic = 0;
 
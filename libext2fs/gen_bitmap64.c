@@ -84,6 +84,36 @@ static void warn_bitmap(ext2fs_generic_bitmap_64 bitmap,
 #define INC_STAT(map, name) ;;
 #endif
 
+/*
+ * Make sure the groups backing bits [start, end] of a lazily read
+ * bitmap are resident before they are used.
+ */
+static errcode_t load_bits(ext2fs_generic_bitmap_64 bmap,
+			   __u64 start, __u64 end)
+{
+	__u64		group, last;
+	errcode_t	retval, ret = 0;
+
+	if (start < bmap->start)
+		start = bmap->start;
+	if (end > bmap->real_end)
+		end = bmap->real_end;
+	if (start > end)
+		return 0;
+
+	group = (start - bmap->start) / bmap->group_bits;
+	last = (end - bmap->start) / bmap->group_bits;
+	for (; group <= last && bmap->load_group; group++) {
+		retval = bmap->load_group(bmap, group);
+		if (retval && !ret)
+			ret = retval;
+	}
+	return ret;
+}
+
+#define LOAD_BITS(map, start, end) \
+	((map)->load_group ? load_bits((map), (start), (end)) : 0)
+
 
 errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 				    int type, __u64 start, __u64 end,
@@ -106,6 +136,9 @@ errcode_t ext2fs_alloc_generic_bmap(ext2_filsys fs, errcode_t magic,
 	case EXT2FS_BMAP64_RBTREE:
 		ops = &ext2fs_blkmap64_rbtree;
 		break;
+	case EXT2FS_BMAP64_ROARING:
+		ops = &ext2fs_blkmap64_roaring;
+		break;
 	case EXT2FS_BMAP64_AUTODIR:
 		retval = ext2fs_get_num_dirs(fs, &num_dirs);
 		if (retval || num_dirs > (fs->super->s_inodes_count / 320))
@@ -184,6 +217,8 @@ void ext2fs_free_generic_bmap(ext2fs_generic_bitmap gen_bmap)
 
 	bmap->bitmap_ops->free_bmap(bmap);
 
+	if (bmap->load_private)
+		ext2fs_free_mem(&bmap->load_private);
 	if (bmap->description) {
 		ext2fs_free_mem(&bmap->description);
 		bmap->description = 0;
@@ -209,6 +244,10 @@ errcode_t ext2fs_copy_generic_bmap(ext2fs_generic_bitmap gen_src,
 	if (!EXT2FS_IS_64_BITMAP(src))
 		return EINVAL;
 
+	retval = LOAD_BITS(src, src->start, src->real_end);
+	if (retval)
+		return retval;
+
 	/* Allocate a new bitmap struct */
 	retval = ext2fs_get_memzero(sizeof(struct ext2fs_struct_generic_bitmap_64),
 				    &new_bmap);
@@ -263,6 +302,7 @@ errcode_t ext2fs_resize_generic_bmap(ext2fs_generic_bitmap gen_bmap,
 				     __u64 new_real_end)
 {
 	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+	errcode_t retval;
 
 	if (!bmap)
 		return EINVAL;
@@ -276,6 +316,10 @@ errcode_t ext2fs_resize_generic_bmap(ext2fs_generic_bitmap gen_bmap,
 
 	INC_STAT(bmap, resize_count);
 
+	retval = LOAD_BITS(bmap, bmap->start, bmap->real_end);
+	if (retval)
+		return retval;
+
 	return bmap->bitmap_ops->resize_bmap(bmap, new_end, new_real_end);
 }
 
@@ -349,8 +393,11 @@ void ext2fs_clear_generic_bmap(ext2fs_generic_bitmap gen_bitmap)
 
 	if (EXT2FS_IS_32_BITMAP(bitmap))
 		ext2fs_clear_generic_bitmap(gen_bitmap);
-	else
+	else {
+		/* Read the rest in so it is not loaded over the cleared bits */
+		(void) LOAD_BITS(bitmap, bitmap->start, bitmap->real_end);
 		bitmap->bitmap_ops->clear_bmap(bitmap);
+	}
 }
 
 int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap gen_bitmap,
@@ -389,6 +436,7 @@ int ext2fs_mark_generic_bmap(ext2fs_generic_bitmap gen_bitmap,
 		return 0;
 	}
 
+	(void) LOAD_BITS(bitmap, arg, arg);
 	return bitmap->bitmap_ops->mark_bmap(bitmap, arg);
 }
 
@@ -421,6 +469,7 @@ int ext2fs_unmark_generic_bmap(ext2fs_generic_bitmap gen_bitmap,
 		return 0;
 	}
 
+	(void) LOAD_BITS(bitmap, arg, arg);
 	return bitmap->bitmap_ops->unmark_bmap(bitmap, arg);
 }
 
@@ -459,6 +508,7 @@ int ext2fs_test_generic_bmap(ext2fs_generic_bitmap gen_bitmap,
 		return 0;
 	}
 
+	(void) LOAD_BITS(bitmap, arg, arg);
 	return bitmap->bitmap_ops->test_bmap(bitmap, arg);
 }
 
@@ -486,6 +536,8 @@ errcode_t ext2fs_set_generic_bmap_range(ext2fs_generic_bitmap gen_bmap,
 
 	INC_STAT(bmap, set_range_count);
 
+	if (num)
+		(void) LOAD_BITS(bmap, start, start + num - 1);
 	return bmap->bitmap_ops->set_bmap_range(bmap, start, num, in);
 }
 
@@ -513,6 +565,12 @@ errcode_t ext2fs_get_generic_bmap_range(ext2fs_generic_bitmap gen_bmap,
 
 	INC_STAT(bmap, get_range_count);
 
+	if (num) {
+		errcode_t retval = LOAD_BITS(bmap, start, start + num - 1);
+
+		if (retval)
+			return retval;
+	}
 	return bmap->bitmap_ops->get_bmap_range(bmap, start, num, out);
 }
 
@@ -565,6 +623,8 @@ void ext2fs_set_generic_bmap_padding(ext2fs_generic_bitmap gen_bmap)
 
 	start = bmap->end + 1;
 	num = bmap->real_end - bmap->end;
+	if (num)
+		(void) LOAD_BITS(bmap, start, start + num - 1);
 	bmap->bitmap_ops->mark_bmap_extent(bmap, start, num);
 	/* XXX ought to warn on error */
 }
@@ -611,6 +671,7 @@ int ext2fs_test_block_bitmap_range2(ext2fs_block_bitmap gen_bmap,
 		return EINVAL;
 	}
 
+	(void) LOAD_BITS(bmap, block, block + num - 1);
 	return bmap->bitmap_ops->test_clear_bmap_extent(bmap, block, num);
 }
 
@@ -652,6 +713,7 @@ void ext2fs_mark_block_bitmap_range2(ext2fs_block_bitmap gen_bmap,
 		return;
 	}
 
+	(void) LOAD_BITS(bmap, block, block + num - 1);
 	bmap->bitmap_ops->mark_bmap_extent(bmap, block, num);
 }
 
@@ -693,9 +755,22 @@ void ext2fs_unmark_block_bitmap_range2(ext2fs_block_bitmap gen_bmap,
 		return;
 	}
 
+	(void) LOAD_BITS(bmap, block, block + num - 1);
 	bmap->bitmap_ops->unmark_bmap_extent(bmap, block, num);
 }
 
+/*
+ * Returns nonzero once every group of the bitmap is in memory.
+ */
+int ext2fs_generic_bmap_resident(ext2fs_generic_bitmap gen_bmap)
+{
+	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+
+	if (!bmap || !EXT2FS_IS_64_BITMAP(bmap))
+		return 1;
+	return bmap->load_group == NULL;
+}
+
 void ext2fs_warn_bitmap32(ext2fs_generic_bitmap gen_bitmap, const char *func)
 {
 }
@@ -738,6 +813,62 @@ errcode_t ext2fs_convert_subcluster_bitmap(ext2_filsys fs,
 	return 0;
 }
 
+/*
+ * Find the first bit in [cstart, cend] (in bitmap units) which is set
+ * or clear, as requested, without loading anything.
+ */
+static errcode_t find_first_resident(ext2fs_generic_bitmap_64 bmap,
+				     __u64 cstart, __u64 cend, int set,
+				     __u64 *out)
+{
+	__u64 cout;
+
+	if (set && bmap->bitmap_ops->find_first_set)
+		return bmap->bitmap_ops->find_first_set(bmap, cstart, cend,
+							out);
+	if (!set && bmap->bitmap_ops->find_first_zero)
+		return bmap->bitmap_ops->find_first_zero(bmap, cstart, cend,
+							 out);
+
+	for (cout = cstart; cout <= cend; cout++)
+		if (!bmap->bitmap_ops->test_bmap(bmap, cout) == !set) {
+			*out = cout;
+			return 0;
+		}
+
+	return ENOENT;
+}
+
+/*
+ * Lazily read bitmaps are searched one group at a time, so that only
+ * the groups up to the first match have to be read in.
+ */
+static errcode_t find_first_bit(ext2fs_generic_bitmap_64 bmap,
+				__u64 cstart, __u64 cend, int set, __u64 *out)
+{
+	__u64		gend;
+	errcode_t	retval;
+
+	while (bmap->load_group) {
+		gend = bmap->start + ((cstart - bmap->start) /
+				      bmap->group_bits + 1) * bmap->group_bits - 1;
+		if (gend >= cend)
+			break;
+		retval = load_bits(bmap, cstart, gend);
+		if (retval)
+			return retval;
+		retval = find_first_resident(bmap, cstart, gend, set, out);
+		if (retval != ENOENT)
+			return retval;
+		cstart = gend + 1;
+	}
+
+	retval = LOAD_BITS(bmap, cstart, cend);
+	if (retval)
+		return retval;
+	return find_first_resident(bmap, cstart, cend, set, out);
+}
+
 errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
 					      __u64 start, __u64 end, __u64 *out)
 {
@@ -775,22 +906,13 @@ errcode_t ext2fs_find_first_zero_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return EINVAL;
 	}
 
-	if (bmap64->bitmap_ops->find_first_zero) {
-		retval = bmap64->bitmap_ops->find_first_zero(bmap64, cstart,
-							     cend, &cout);
-		if (retval)
-			return retval;
-	found:
-		cout <<= bmap64->cluster_bits;
-		*out = (cout >= start) ? cout : start;
-		return 0;
-	}
-
-	for (cout = cstart; cout <= cend; cout++)
-		if (!bmap64->bitmap_ops->test_bmap(bmap64, cout))
-			goto found;
+	retval = find_first_bit(bmap64, cstart, cend, 0, &cout);
+	if (retval)
+		return retval;
 
-	return ENOENT;
+	cout <<= bmap64->cluster_bits;
+	*out = (cout >= start) ? cout : start;
+	return 0;
 }
 
 errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
@@ -830,22 +952,111 @@ errcode_t ext2fs_find_first_set_generic_bmap(ext2fs_generic_bitmap bitmap,
 		return EINVAL;
 	}
 
-	if (bmap64->bitmap_ops->find_first_set) {
-		retval = bmap64->bitmap_ops->find_first_set(bmap64, cstart,
-							    cend, &cout);
+	retval = find_first_bit(bmap64, cstart, cend, 1, &cout);
+	if (retval)
+		return retval;
+
+	cout <<= bmap64->cluster_bits;
+	*out = (cout >= start) ? cout : start;
+	return 0;
+}
+
+/*
+ * Find the last set bit in [cstart, cend] (in bitmap units) without
+ * loading anything.
+ */
+static errcode_t find_last_resident(ext2fs_generic_bitmap_64 bmap,
+				    __u64 cstart, __u64 cend, __u64 *out)
+{
+	__u64 cout;
+
+	if (bmap->bitmap_ops->find_last_set)
+		return bmap->bitmap_ops->find_last_set(bmap, cstart, cend,
+						       out);
+
+	for (cout = cend + 1; cout-- > cstart; )
+		if (bmap->bitmap_ops->test_bmap(bmap, cout)) {
+			*out = cout;
+			return 0;
+		}
+
+	return ENOENT;
+}
+
+/*
+ * Lazily read bitmaps are searched backwards one group at a time, so
+ * that only the groups after the last match have to be read in.
+ */
+static errcode_t find_last_bit(ext2fs_generic_bitmap_64 bmap,
+			       __u64 cstart, __u64 cend, __u64 *out)
+{
+	__u64		gstart;
+	errcode_t	retval;
+
+	while (bmap->load_group) {
+		gstart = bmap->start + ((cend - bmap->start) /
+					bmap->group_bits) * bmap->group_bits;
+		if (gstart <= cstart)
+			break;
+		retval = load_bits(bmap, gstart, cend);
 		if (retval)
 			return retval;
-	found:
-		cout <<= bmap64->cluster_bits;
-		*out = (cout >= start) ? cout : start;
-		return 0;
+		retval = find_last_resident(bmap, gstart, cend, out);
+		if (retval != ENOENT)
+			return retval;
+		cend = gstart - 1;
 	}
 
-	for (cout = cstart; cout <= cend; cout++)
-		if (bmap64->bitmap_ops->test_bmap(bmap64, cout))
-			goto found;
+	retval = LOAD_BITS(bmap, cstart, cend);
+	if (retval)
+		return retval;
+	return find_last_resident(bmap, cstart, cend, out);
+}
 
-	return ENOENT;
+errcode_t ext2fs_find_last_set_generic_bmap(ext2fs_generic_bitmap bitmap,
+					    __u64 start, __u64 end, __u64 *out)
+{
+	ext2fs_generic_bitmap_64 bmap64 = (ext2fs_generic_bitmap_64) bitmap;
+	__u64 cstart, cend, cout;
+	errcode_t retval;
+
+	if (!bitmap)
+		return EINVAL;
+
+	if (EXT2FS_IS_32_BITMAP(bitmap)) {
+		if (((start) & ~0xffffffffULL) ||
+		    ((end) & ~0xffffffffULL) || start > end) {
+			ext2fs_warn_bitmap2(bitmap, EXT2FS_TEST_ERROR, start);
+			return EINVAL;
+		}
+
+		for (cout = end + 1; cout-- > start; )
+			if (ext2fs_test_generic_bitmap(bitmap, cout)) {
+				*out = cout;
+				return 0;
+			}
+		return ENOENT;
+	}
+
+	if (!EXT2FS_IS_64_BITMAP(bitmap))
+		return EINVAL;
+
+	cstart = start >> bmap64->cluster_bits;
+	cend = end >> bmap64->cluster_bits;
+
+	if (cstart < bmap64->start || cend > bmap64->end || start > end) {
+		warn_bitmap(bmap64, EXT2FS_TEST_ERROR, start);
+		return EINVAL;
+	}
+
+	retval = find_last_bit(bmap64, cstart, cend, &cout);
+	if (retval)
+		return retval;
+
+	/* The last block of the cluster found, clamped to the range */
+	cout = ((cout + 1) << bmap64->cluster_bits) - 1;
+	*out = (cout <= end) ? cout : end;
+	return 0;
 }
 
 errcode_t ext2fs_count_used_clusters(ext2_filsys fs, blk64_t start,
@@ -72,6 +72,7 @@ errcode_t ext2fs_flush_icache(ext2_filsys fs)
 		fs->icache->cache[i].ino = 0;
 
 	fs->icache->buffer_blk = 0;
+	fs->icache->buffer_csum_ino = 0;
 	return 0;
 }
 
@@ -836,6 +837,7 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 			clen = fs->blocksize - offset;
 
 		if (block_nr != fs->icache->buffer_blk) {
+			fs->icache->buffer_csum_ino = 0;
 			retval = io_channel_read_blk64(io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
@@ -854,7 +856,16 @@ errcode_t ext2fs_read_inode2(ext2_filsys fs, ext2_ino_t ino,
 	length = EXT2_INODE_SIZE(fs->super);
 
 	/* Verify the inode checksum. */
-	fail_csum = !ext2fs_inode_csum_verify(fs, ino, iptr);
+	/*
+	 * Only an exact match may seed incremental checksum updates;
+	 * ext2fs_inode_csum_verify() also passes all-zero inodes.
+	 */
+	if (ext2fs_inode_csum_matches(fs, ino, iptr)) {
+		fail_csum = 0;
+		if (io == fs->io)
+			fs->icache->buffer_csum_ino = ino;
+	} else
+		fail_csum = !ext2fs_inode_csum_verify(fs, ino, iptr);
 
 #ifdef WORDS_BIGENDIAN
 	ext2fs_swap_inode_full(fs, (struct ext2_inode_large *) iptr,
@@ -898,6 +909,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	unsigned long block, offset;
 	errcode_t retval = 0;
 	struct ext2_inode_large *w_inode;
+	ext2_ino_t csum_ino = 0;
 	char *ptr;
 	unsigned i;
 	int clen;
@@ -931,6 +943,11 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 			goto errout;
 	}
 
+	/* A reused directory inode gets a new generation */
+	if ((ext2_ino_t) fs->dir_verify_tag == ino)
+		fs->dir_verify_tag = EXT2_VERIFY_TAG(ino,
+						     inode->i_generation);
+
 	/* Check to see if the inode cache needs to be updated */
 	if (fs->icache) {
 		for (i=0; i < fs->icache->cache_size; i++) {
@@ -956,12 +973,6 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 	ext2fs_swap_inode_full(fs, w_inode, w_inode, 1, length);
 #endif
 
-	if ((flags & WRITE_INODE_NOCSUM) == 0) {
-		retval = ext2fs_inode_csum_set(fs, ino, w_inode);
-		if (retval)
-			goto errout;
-	}
-
 	group = (ino - 1) / EXT2_INODES_PER_GROUP(fs->super);
 	offset = ((ino - 1) % EXT2_INODES_PER_GROUP(fs->super)) *
 		EXT2_INODE_SIZE(fs->super);
@@ -981,6 +992,24 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 
 	offset &= (EXT2_BLOCK_SIZE(fs->super) - 1);
 
+	/*
+	 * If the buffer holds the previous version of this inode with a
+	 * good checksum, patch that checksum for the bytes that changed
+	 * instead of hashing the whole inode again.
+	 */
+	if ((flags & WRITE_INODE_NOCSUM) == 0) {
+		if (offset + length <= fs->blocksize)
+			csum_ino = ino;
+		if (!csum_ino || fs->icache->buffer_blk != block_nr ||
+		    fs->icache->buffer_csum_ino != ino ||
+		    !ext2fs_inode_csum_update(fs, w_inode,
+				(struct ext2_inode_large *)
+				((char *) fs->icache->buffer + offset)))
+			retval = ext2fs_inode_csum_set(fs, ino, w_inode);
+		if (retval)
+			goto errout;
+	}
+
 	ptr = (char *) w_inode;
 
 	while (length) {
@@ -989,6 +1018,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 			clen = fs->blocksize - offset;
 
 		if (fs->icache->buffer_blk != block_nr) {
+			fs->icache->buffer_csum_ino = 0;
 			retval = io_channel_read_blk64(fs->io, block_nr, 1,
 						     fs->icache->buffer);
 			if (retval)
@@ -1011,6 +1041,7 @@ errcode_t ext2fs_write_inode2(ext2_filsys fs, ext2_ino_t ino,
 		block_nr++;
 	}
 
+	fs->icache->buffer_csum_ino = csum_ino;
 	fs->flags |= EXT2_FLAG_CHANGED;
 errout:
 	ext2fs_free_mem(&w_inode);
@@ -149,3 +149,34 @@ errcode_t io_channel_cache_readahead(io_channel io, unsigned long long block,
 
 	return io->manager->cache_readahead(io, block, count);
 }
+
+/*
+ * Read one block and check it with verify, setting *verified to the
+ * result.  An I/O manager with a block cache can remember that the
+ * cached copy passed verify under tag and skip the check on later
+ * reads with the same verify and tag until the block is written
+ * again, so checksums are computed once per device read rather than
+ * once per access.  verify may be called with no locks held and may
+ * itself do I/O on the channel.
+ */
+errcode_t io_channel_read_blk64_verify(io_channel channel,
+				       unsigned long long block, void *data,
+				       unsigned long long tag,
+				       io_verify_func verify, void *priv,
+				       int *verified)
+{
+	errcode_t retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->read_blk_verify)
+		return channel->manager->read_blk_verify(channel, block, data,
+							 tag, verify, priv,
+							 verified);
+
+	retval = io_channel_read_blk64(channel, block, 1, data);
+	if (retval)
+		return retval;
+	*verified = (*verify)(data, priv);
+	return 0;
+}
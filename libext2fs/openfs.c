@@ -28,7 +28,7 @@
 
 #include "ext2_fs.h"
 
-#include "ext2fs.h"
+#include "ext2fsP.h"
 #include "e2image.h"
 
 blk64_t ext2fs_descriptor_block_loc2(ext2_filsys fs, blk64_t group_block,
@@ -92,10 +92,128 @@ errcode_t ext2fs_open(vnode_t vp, int flags, int superblock,
 			    manager, ret_fs);
 }
 
-static void block_sha_map_free_entry(void *data)
+/* Descriptor blocks below which group descriptors are loaded serially */
+#define DESC_BLOCKS_PER_THREAD	16
+
+struct desc_loader {
+	ext2_filsys	fs;
+	blk64_t		group_block;
+	unsigned long	first_meta_bg;
+	unsigned long	start;		/* descriptor blocks start..end-1 */
+	unsigned long	end;
+	int		direct;		/* read around the I/O cache */
+	int		verify;
+	int		csum_bad;
+	errcode_t	retval;
+};
+
+/*
+ * Read the meta_bg descriptor blocks of a range (those before
+ * first_meta_bg have been read already), byte swap the descriptors in
+ * it and check their checksums.
+ */
+static void load_desc_blocks(void *data)
 {
-	e2fsmac_free(data);
-	return;
+	struct desc_loader *dl = data;
+	ext2_filsys	fs = dl->fs;
+	dgrp_t		group, last;
+	unsigned long	i;
+	blk64_t		blk;
+	char		*dest;
+
+	for (i = dl->start; i < dl->end; i++) {
+		dest = (char *) fs->group_desc + i * fs->blocksize;
+		if (i >= dl->first_meta_bg) {
+			blk = ext2fs_descriptor_block_loc2(fs, dl->group_block,
+							   i);
+			dl->retval = io_channel_read_blk64(fs->io, blk,
+				dl->direct ? -(int) fs->blocksize : 1, dest);
+			if (dl->retval)
+				return;
+		}
+
+		group = i * EXT2_DESC_PER_BLOCK(fs->super);
+		last = group + EXT2_DESC_PER_BLOCK(fs->super);
+		if (last > fs->group_desc_count)
+			last = fs->group_desc_count;
+		for (; group < last; group++) {
+#ifdef WORDS_BIGENDIAN
+			ext2fs_swap_group_desc2(fs,
+				ext2fs_group_desc(fs, fs->group_desc, group));
+#endif
+			if (dl->verify &&
+			    !ext2fs_group_desc_csum_verify(fs, group))
+				dl->csum_bad = 1;
+		}
+	}
+}
+
+/*
+ * Finish loading the group descriptors.  With a channel that allows
+ * threads, the descriptor blocks are split between a thread per CPU,
+ * so that meta_bg blocks are read and all checksums are checked in
+ * parallel.
+ */
+static errcode_t load_group_descs(ext2_filsys fs, int flags, int superblock,
+				  blk64_t group_block,
+				  unsigned long first_meta_bg)
+{
+	struct desc_loader *dl;
+	unsigned long	per_thread, i;
+	int		num = 1, verify, csum_bad = 0;
+	errcode_t	retval;
+
+	/*
+	 * Descriptors read from a backup have their checksums reset by
+	 * the caller, so only the primary copy is checked.
+	 */
+	verify = ext2fs_has_group_desc_csum(fs) && superblock <= 1 &&
+		!(flags & EXT2_FLAG_IGNORE_CSUM_ERRORS);
+
+	if ((fs->io->flags & CHANNEL_FLAGS_THREADS) &&
+	    !(fs->flags & EXT2_FLAG_IMAGE_FILE)) {
+		num = ext2fs_get_num_cpus();
+		if ((unsigned long) num >
+		    fs->desc_blocks / DESC_BLOCKS_PER_THREAD)
+			num = fs->desc_blocks / DESC_BLOCKS_PER_THREAD;
+		if (num < 1)
+			num = 1;
+	}
+	if (num == 1) {
+		for (i = first_meta_bg; i < fs->desc_blocks; i++)
+			io_channel_cache_readahead(fs->io,
+				ext2fs_descriptor_block_loc2(fs, group_block, i),
+				1);
+	}
+
+	retval = ext2fs_get_arrayzero(num, sizeof(struct desc_loader), &dl);
+	if (retval)
+		return retval;
+	per_thread = (fs->desc_blocks + num - 1) / num;
+	for (i = 0; i < (unsigned long) num; i++) {
+		dl[i].fs = fs;
+		dl[i].group_block = group_block;
+		dl[i].first_meta_bg = first_meta_bg;
+		dl[i].start = i * per_thread;
+		dl[i].end = dl[i].start + per_thread;
+		if (dl[i].end > fs->desc_blocks)
+			dl[i].end = fs->desc_blocks;
+		dl[i].direct = num > 1;
+		dl[i].verify = verify;
+	}
+	ext2fs_run_threads(load_desc_blocks, dl, sizeof(struct desc_loader),
+			   num);
+	for (i = 0; i < (unsigned long) num; i++) {
+		if (dl[i].retval && !retval)
+			retval = dl[i].retval;
+		csum_bad |= dl[i].csum_bad;
+	}
+	ext2fs_free_mem(&dl);
+
+	/* Like the kernel, refuse only to write with bad descriptors */
+	if (!retval && csum_bad && (flags & EXT2_FLAG_RW))
+		retval = EXT2_ET_BAD_CRC;
+	return retval;
 }
 
 /*
@@ -119,19 +237,14 @@ errcode_t ext2fs_open2(vnode_t vp, const char *io_options,
 {
 	ext2_filsys	fs;
 	errcode_t	retval;
-	unsigned long	i, first_meta_bg;
+	unsigned long	first_meta_bg;
 	__u32		features;
 	unsigned int	blocks_per_group, io_flags;
-	blk64_t		group_block, blk;
+	blk64_t		group_block;
 	char		*dest, *cp;
 	int		group_zero_adjust = 0;
 	unsigned int	inode_size;
 	__u64		groups_cnt;
-#ifdef WORDS_BIGENDIAN
-	unsigned int	groups_per_block;
-	struct ext2_group_desc *gdp;
-	int		j;
-#endif
 	int		csum_retries = 0;
     int     pathlen = MAXPATHLEN;
 
@@ -404,6 +517,9 @@ retry:
 		retval = EXT2_ET_CORRUPT_SUPERBLOCK;
 		goto cleanup;
 	}
+	retval = ext2fs_update_group_layout(fs);
+	if (retval)
+		goto cleanup;
 	fs->desc_blocks = ext2fs_div_ceil(fs->group_desc_count,
 					  EXT2_DESC_PER_BLOCK(fs->super));
 	if (ext2fs_has_feature_meta_bg(fs->super) &&
@@ -434,9 +550,6 @@ retry:
 	if (group_block == 0 && fs->blocksize == 1024)
 		group_zero_adjust = 1;
 	dest = (char *) fs->group_desc;
-#ifdef WORDS_BIGENDIAN
-	groups_per_block = EXT2_DESC_PER_BLOCK(fs->super);
-#endif
 	if (ext2fs_has_feature_meta_bg(fs->super) &&
 	    !(flags & EXT2_FLAG_IMAGE_FILE)) {
 		first_meta_bg = fs->super->s_first_meta_bg;
@@ -450,37 +563,11 @@ retry:
 					     first_meta_bg, dest);
 		if (retval)
 			goto cleanup;
-#ifdef WORDS_BIGENDIAN
-		gdp = (struct ext2_group_desc *) dest;
-		for (j=0; j < groups_per_block*first_meta_bg; j++) {
-			gdp = ext2fs_group_desc(fs, fs->group_desc, j);
-			if (gdp)
-				ext2fs_swap_group_desc2(fs, gdp);
-		}
-#endif
-		dest += fs->blocksize*first_meta_bg;
-	}
-
-	for (i = first_meta_bg ; i < fs->desc_blocks; i++) {
-		blk = ext2fs_descriptor_block_loc2(fs, group_block, i);
-		io_channel_cache_readahead(fs->io, blk, 1);
-	}
-
-	for (i=first_meta_bg ; i < fs->desc_blocks; i++) {
-		blk = ext2fs_descriptor_block_loc2(fs, group_block, i);
-		retval = io_channel_read_blk64(fs->io, blk, 1, dest);
-		if (retval)
-			goto cleanup;
-#ifdef WORDS_BIGENDIAN
-		for (j=0; j < groups_per_block; j++) {
-			gdp = ext2fs_group_desc(fs, fs->group_desc,
-						i * groups_per_block + j);
-			if (gdp)
-				ext2fs_swap_group_desc2(fs, gdp);
-		}
-#endif
-		dest += fs->blocksize;
 	}
+	retval = load_group_descs(fs, flags, superblock, group_block,
+				  first_meta_bg);
+	if (retval)
+		goto cleanup;
 
 	fs->stride = fs->super->s_raid_stride;
 
@@ -514,13 +601,14 @@ skip_read_bg:
 		}
 	}
 
+	/* The extent block cache is only an optimization */
+	if (!(fs->flags & EXT2_FLAG_IMAGE_FILE))
+		ext2fs_create_extent_cache(fs);
+
 	if (fs->flags & EXT2_FLAG_SHARE_DUP) {
-		fs->block_sha_map = ext2fs_hashmap_create(ext2fs_djb2_hash,
-					block_sha_map_free_entry, 4096);
-		if (!fs->block_sha_map) {
-			retval = EXT2_ET_NO_MEMORY;
+		retval = ext2fs_dedup_create(fs);
+		if (retval)
 			goto cleanup;
-		}
 		ext2fs_set_feature_shared_blocks(fs->super);
 	}
 
@@ -27,11 +27,36 @@
 #endif
 
 #include "ext2_fs.h"
-#include "ext2fs.h"
+#include "ext2fsP.h"
+#include "bmap64.h"
 #include "e2image.h"
 
+/*
+ * Threads and locks for the parallel bitmap reader: pthreads on the
+ * host, kernel threads (see e2fsmac/thread.c) in the kext.
+ */
 #ifdef HAVE_PTHREAD
 typedef pthread_mutex_t mutex_t;
+typedef pthread_t rbt_thread_t;
+
+static errcode_t rbt_mutex_create(mutex_t **mutex)
+{
+	errcode_t retval;
+
+	retval = ext2fs_get_mem(sizeof(mutex_t), mutex);
+	if (retval)
+		return retval;
+	retval = pthread_mutex_init(*mutex, NULL);
+	if (retval)
+		ext2fs_free_mem(mutex);
+	return retval;
+}
+
+static void rbt_mutex_destroy(mutex_t *mutex)
+{
+	pthread_mutex_destroy(mutex);
+	ext2fs_free_mem(&mutex);
+}
 
 static void unix_pthread_mutex_lock(mutex_t *mutex)
 {
@@ -43,12 +68,224 @@ static void unix_pthread_mutex_unlock(mutex_t *mutex)
 	if (mutex)
 		pthread_mutex_unlock(mutex);
 }
+
+struct rbt_pthread_start {
+	void	(*func)(void *);
+	void	*arg;
+};
+
+static void *rbt_pthread_main(void *data)
+{
+	struct rbt_pthread_start start = *(struct rbt_pthread_start *) data;
+
+	ext2fs_free_mem(&data);
+	start.func(start.arg);
+	return NULL;
+}
+
+static errcode_t rbt_thread_create(rbt_thread_t *thread,
+				   void (*func)(void *), void *arg)
+{
+	struct rbt_pthread_start *start;
+	errcode_t retval;
+
+	retval = ext2fs_get_mem(sizeof(*start), &start);
+	if (retval)
+		return retval;
+	start->func = func;
+	start->arg = arg;
+	retval = pthread_create(thread, NULL, rbt_pthread_main, start);
+	if (retval)
+		ext2fs_free_mem(&start);
+	return retval;
+}
+
+static void rbt_thread_join(rbt_thread_t thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static int rbt_num_cpus(void)
+{
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_CONF)
+	long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	if (num_cpus > 0)
+		return num_cpus;
+#endif
+	/*
+	 * Guess for now; eventually we should probably define
+	 * ext2fs_get_num_cpus() and teach it how to get this info on
+	 * MacOS, FreeBSD, etc.
+	 * ref: https://stackoverflow.com/questions/150355
+	 */
+	return 4;
+}
 #else
-typedef int mutex_t;
-#define unix_pthread_mutex_lock(mutex_t) do {} while (0)
-#define unix_pthread_mutex_unlock(mutex_t) do {} while (0)
+typedef lck_mtx_t mutex_t;
+typedef e2fsmac_thread_t rbt_thread_t;
+
+static errcode_t rbt_mutex_create(mutex_t **mutex)
+{
+	*mutex = e2fsmac_mutex_alloc();
+	return *mutex ? 0 : EXT2_ET_NO_MEMORY;
+}
+
+#define rbt_mutex_destroy(mutex) e2fsmac_mutex_free(mutex)
+
+static void unix_pthread_mutex_lock(mutex_t *mutex)
+{
+	if (mutex)
+		lck_mtx_lock(mutex);
+}
+static void unix_pthread_mutex_unlock(mutex_t *mutex)
+{
+	if (mutex)
+		lck_mtx_unlock(mutex);
+}
+
+#define rbt_thread_create(thread, func, arg) \
+	e2fsmac_thread_create(thread, func, arg)
+#define rbt_thread_join(thread) e2fsmac_thread_join(thread)
+#define rbt_num_cpus() e2fsmac_ncpus()
 #endif
 
+int ext2fs_get_num_cpus(void)
+{
+	return rbt_num_cpus();
+}
+
+/*
+ * Call func on each of num argument blocks of size bytes at args, the
+ * first in the calling thread and the others in threads of their own.
+ * Blocks whose thread cannot be started are run in the calling thread.
+ */
+void ext2fs_run_threads(void (*func)(void *), void *args, size_t size,
+			int num)
+{
+	rbt_thread_t	*thread_ids = NULL;
+	char		*arg = args;
+	int		i, started = 0;
+
+	if (num > 1 &&
+	    ext2fs_get_array(num - 1, sizeof(rbt_thread_t), &thread_ids))
+		thread_ids = NULL;
+	for (i = 1; thread_ids && i < num; i++) {
+		if (rbt_thread_create(&thread_ids[i - 1], func,
+				      arg + i * size))
+			break;
+		started++;
+	}
+
+	func(arg);
+	for (i = started + 1; i < num; i++)
+		func(arg + i * size);
+	for (i = 0; i < started; i++)
+		rbt_thread_join(thread_ids[i]);
+	if (thread_ids)
+		ext2fs_free_mem(&thread_ids);
+}
+
+/*
+ * Locks for other library caches shared between threads.
+ */
+errcode_t ext2fs_mutex_create(void **mutex)
+{
+	return rbt_mutex_create((mutex_t **) mutex);
+}
+
+void ext2fs_mutex_destroy(void *mutex)
+{
+	rbt_mutex_destroy((mutex_t *) mutex);
+}
+
+void ext2fs_mutex_lock(void *mutex)
+{
+	unix_pthread_mutex_lock(mutex);
+}
+
+void ext2fs_mutex_unlock(void *mutex)
+{
+	unix_pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Bitmaps read with EXT2FS_BITMAPS_LAZY keep the state of each group
+ * here.  A group is read and verified the first time any of its bits
+ * is used; a group whose bitmap cannot be read is marked fully in use
+ * so nothing is allocated from it, and is never written back.  The
+ * error is returned to the caller which caused the load, and unless
+ * EXT2_FLAG_IGNORE_CSUM_ERRORS is set the file system is marked as
+ * having errors.
+ */
+#define LAZY_GROUP_UNLOADED	0
+#define LAZY_GROUP_LOADED	1
+#define LAZY_GROUP_FAILED	2
+
+struct lazy_bitmap {
+	int		inode;		/* inode rather than block bitmap */
+	dgrp_t		unloaded;	/* groups not read in yet */
+	unsigned char	*state;		/* LAZY_GROUP_* for each group */
+};
+
+/*
+ * Returns nonzero if the bitmap of the group is in memory and so may
+ * be written back.
+ */
+static int group_resident(ext2fs_generic_bitmap gen_bmap, dgrp_t group)
+{
+	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+	struct lazy_bitmap *lazy;
+
+	if (!EXT2FS_IS_64_BITMAP(bmap) || !bmap->load_private)
+		return 1;
+	lazy = bmap->load_private;
+	return lazy->state[group] == LAZY_GROUP_LOADED;
+}
+
+/*
+ * The allocation statistics functions record which groups they
+ * changed, so that flushing the bitmaps only has to checksum and
+ * write those groups, and ext2fs_set_gdt_csum() only has to revisit
+ * their descriptors.  EXT2_FLAG_{BB,IB}_DIRTY still mean the whole
+ * bitmap has to be written.
+ */
+static void mark_group_dirty(ext2_filsys fs, dgrp_t group, int mask,
+			     int group_flag, int all_flag)
+{
+	if (group >= fs->group_desc_count ||
+	    (!fs->dirty_groups &&
+	     ext2fs_get_memzero(fs->group_desc_count, &fs->dirty_groups))) {
+		fs->flags |= all_flag | EXT2_FLAG_CHANGED;
+		fs->flags &= ~EXT2_FLAG_GDT_CSUM_CLEAN;
+		return;
+	}
+	fs->dirty_groups[group] |= mask | GROUP_GDT_DIRTY;
+	fs->flags |= group_flag | EXT2_FLAG_CHANGED;
+}
+
+void ext2fs_mark_bb_group_dirty(ext2_filsys fs, dgrp_t group)
+{
+	mark_group_dirty(fs, group, GROUP_BB_DIRTY,
+			 EXT2_FLAG_BB_GROUP_DIRTY, EXT2_FLAG_BB_DIRTY);
+}
+
+void ext2fs_mark_ib_group_dirty(ext2_filsys fs, dgrp_t group)
+{
+	mark_group_dirty(fs, group, GROUP_IB_DIRTY,
+			 EXT2_FLAG_IB_GROUP_DIRTY, EXT2_FLAG_IB_DIRTY);
+}
+
+/*
+ * Returns nonzero if only the groups marked in fs->dirty_groups need
+ * to be written.
+ */
+static int only_dirty_groups(ext2_filsys fs, int all_flag, int group_flag)
+{
+	return fs->dirty_groups &&
+		(fs->flags & (all_flag | group_flag)) == group_flag;
+}
+
 static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
 	dgrp_t 		i;
@@ -61,6 +298,7 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	blk64_t		blk;
 	blk64_t		blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
 	ext2_ino_t	ino_itr = 1;
+	int		block_dirty_only, inode_dirty_only;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
@@ -68,6 +306,10 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		return EXT2_ET_RO_FILSYS;
 
 	csum_flag = ext2fs_has_group_desc_csum(fs);
+	block_dirty_only = only_dirty_groups(fs, EXT2_FLAG_BB_DIRTY,
+					     EXT2_FLAG_BB_GROUP_DIRTY);
+	inode_dirty_only = only_dirty_groups(fs, EXT2_FLAG_IB_DIRTY,
+					     EXT2_FLAG_IB_GROUP_DIRTY);
 
 	inode_nbytes = block_nbytes = 0;
 	if (do_block) {
@@ -93,6 +335,11 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT)
 		    )
 			goto skip_this_block_bitmap;
+		if (!group_resident(fs->block_map, i))
+			goto skip_this_block_bitmap;
+		if (block_dirty_only &&
+		    !(fs->dirty_groups[i] & GROUP_BB_DIRTY))
+			goto skip_this_block_bitmap;
 
 		retval = ext2fs_get_block_bitmap_range2(fs->block_map,
 				blk_itr, block_nbytes << 3, block_buf);
@@ -136,6 +383,11 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		if (csum_flag && ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT)
 		    )
 			goto skip_this_inode_bitmap;
+		if (!group_resident(fs->inode_map, i))
+			goto skip_this_inode_bitmap;
+		if (inode_dirty_only &&
+		    !(fs->dirty_groups[i] & GROUP_IB_DIRTY))
+			goto skip_this_inode_bitmap;
 
 		retval = ext2fs_get_inode_bitmap_range2(fs->inode_map,
 				ino_itr, inode_nbytes << 3, inode_buf);
@@ -162,12 +414,19 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 		ino_itr += inode_nbytes << 3;
 
 	}
+	if (fs->dirty_groups) {
+		int mask = (do_block ? GROUP_BB_DIRTY : 0) |
+			(do_inode ? GROUP_IB_DIRTY : 0);
+
+		for (i = 0; i < fs->group_desc_count; i++)
+			fs->dirty_groups[i] &= ~mask;
+	}
 	if (do_block) {
-		fs->flags &= ~EXT2_FLAG_BB_DIRTY;
+		fs->flags &= ~(EXT2_FLAG_BB_DIRTY | EXT2_FLAG_BB_GROUP_DIRTY);
 		ext2fs_free_mem(&block_buf);
 	}
 	if (do_inode) {
-		fs->flags &= ~EXT2_FLAG_IB_DIRTY;
+		fs->flags &= ~(EXT2_FLAG_IB_DIRTY | EXT2_FLAG_IB_GROUP_DIRTY);
 		ext2fs_free_mem(&inode_buf);
 	}
 	return 0;
@@ -226,6 +485,168 @@ static int bitmap_tail_verify(unsigned char *bitmap, int first, int last)
 	return 1;
 }
 
+/*
+ * Read and verify the block (or inode) bitmap of one group into buf.
+ * Groups without an initialized bitmap on disk read as all zeroes.
+ * Direct reads bypass the I/O cache, which parallel readers would
+ * otherwise serialize on and flush each other's blocks out of.
+ */
+static errcode_t read_group_bitmap(ext2_filsys fs, dgrp_t group, int inode,
+				   int direct, char *buf, int *tail_flags)
+{
+	int		nbytes;
+	blk64_t		blk;
+	errcode_t	retval;
+
+	if (inode) {
+		nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
+		blk = ext2fs_inode_bitmap_loc(fs, group);
+		if (ext2fs_has_group_desc_csum(fs) &&
+		    ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT) &&
+		    ext2fs_group_desc_csum_verify(fs, group))
+			blk = 0;
+	} else {
+		nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
+		blk = ext2fs_block_bitmap_loc(fs, group);
+		if (ext2fs_has_group_desc_csum(fs) &&
+		    ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT) &&
+		    ext2fs_group_desc_csum_verify(fs, group))
+			blk = 0;
+	}
+	if (blk >= ext2fs_blocks_count(fs->super))
+		blk = 0;
+
+	if (!blk) {
+		memset(buf, 0, nbytes);
+		return 0;
+	}
+
+	retval = io_channel_read_blk64(fs->io, blk,
+				       direct ? -(int) fs->blocksize : 1, buf);
+	if (retval)
+		return inode ? EXT2_ET_INODE_BITMAP_READ :
+			EXT2_ET_BLOCK_BITMAP_READ;
+
+	/* verify bitmap checksum */
+	if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)) {
+		if (inode && !ext2fs_inode_bitmap_csum_verify(fs, group,
+							      buf, nbytes))
+			return EXT2_ET_INODE_BITMAP_CSUM_INVALID;
+		if (!inode && !ext2fs_block_bitmap_csum_verify(fs, group,
+							       buf, nbytes))
+			return EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
+	}
+	if (!bitmap_tail_verify((unsigned char *) buf, nbytes,
+				fs->blocksize - 1))
+		*tail_flags |= inode ? EXT2_FLAG_IBITMAP_TAIL_PROBLEM :
+			EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
+	return 0;
+}
+
+/*
+ * Read in one group of a lazily read bitmap.  With a mutex, several
+ * threads may be loading different groups of the same bitmap; each
+ * reads its group around the I/O cache and only installs it under the
+ * lock.
+ */
+static errcode_t lazy_load_group(ext2fs_generic_bitmap_64 bmap, dgrp_t group,
+				 mutex_t *mutex)
+{
+	struct lazy_bitmap *lazy = bmap->load_private;
+	ext2_filsys	fs = bmap->fs;
+	__u64		first;
+	char		*buf;
+	int		tail_flags = 0;
+	errcode_t	retval;
+
+	if (group >= fs->group_desc_count ||
+	    lazy->state[group] != LAZY_GROUP_UNLOADED)
+		return 0;
+
+	first = bmap->start + (__u64) group * bmap->group_bits;
+	retval = io_channel_alloc_buf(fs->io, 0, &buf);
+	if (retval == 0) {
+		retval = read_group_bitmap(fs, group, lazy->inode,
+					   mutex != NULL, buf, &tail_flags);
+		if (retval == 0) {
+			unix_pthread_mutex_lock(mutex);
+			retval = bmap->bitmap_ops->set_bmap_range(bmap, first,
+							bmap->group_bits, buf);
+			unix_pthread_mutex_unlock(mutex);
+		}
+		ext2fs_free_mem(&buf);
+	}
+
+	unix_pthread_mutex_lock(mutex);
+	if (retval) {
+		bmap->bitmap_ops->mark_bmap_extent(bmap, first,
+						   bmap->group_bits);
+		lazy->state[group] = LAZY_GROUP_FAILED;
+		/*
+		 * The group descriptor now disagrees with the bitmap, so
+		 * have the file system checked, as a failed read of the
+		 * whole bitmap would have.
+		 */
+		if (!(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS)) {
+			ext2fs_unmark_valid(fs);
+			fs->super->s_state |= EXT2_ERROR_FS;
+			ext2fs_mark_super_dirty(fs);
+		}
+	} else
+		lazy->state[group] = LAZY_GROUP_LOADED;
+	fs->flags |= tail_flags;
+
+	if (--lazy->unloaded == 0)
+		bmap->load_group = NULL;
+	unix_pthread_mutex_unlock(mutex);
+	return retval;
+}
+
+/*
+ * load_group callback of lazily read bitmaps.
+ */
+static errcode_t load_lazy_group(ext2fs_generic_bitmap_64 bmap, __u64 group)
+{
+	return lazy_load_group(bmap, group, NULL);
+}
+
+/*
+ * Arrange for a freshly allocated (all zero) bitmap to be read in one
+ * group at a time.  Legacy 32-bit bitmaps are left alone and have to
+ * be read in whole.
+ */
+static errcode_t setup_lazy_bitmap(ext2_filsys fs,
+				   ext2fs_generic_bitmap gen_bmap, int inode)
+{
+	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+	struct lazy_bitmap *lazy;
+	errcode_t	retval;
+
+	if (!EXT2FS_IS_64_BITMAP(bmap) || !fs->group_desc_count)
+		return 0;
+
+	retval = ext2fs_get_memzero(sizeof(struct lazy_bitmap) +
+				    fs->group_desc_count, &lazy);
+	if (retval)
+		return retval;
+	lazy->inode = inode;
+	lazy->unloaded = fs->group_desc_count;
+	lazy->state = (unsigned char *) (lazy + 1);
+
+	bmap->load_private = lazy;
+	bmap->group_bits = inode ? EXT2_INODES_PER_GROUP(fs->super) :
+		EXT2_CLUSTERS_PER_GROUP(fs->super);
+	bmap->load_group = load_lazy_group;
+	return 0;
+}
+
+static int bitmap_is_lazy(ext2fs_generic_bitmap gen_bmap)
+{
+	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+
+	return EXT2FS_IS_64_BITMAP(bmap) && bmap->load_private;
+}
+
 static errcode_t read_bitmaps_range_prepare(ext2_filsys fs, int flags)
 {
 	errcode_t retval;
@@ -246,6 +667,7 @@ static errcode_t read_bitmaps_range_prepare(ext2_filsys fs, int flags)
 		return retval;
 
 	if (flags & EXT2FS_BITMAPS_BLOCK) {
+		ext2fs_free_extents_invalidate(fs);
 		if (fs->block_map)
 			ext2fs_free_block_bitmap(fs->block_map);
 		strlcpy(buf, "block bitmap for ", 18);
@@ -269,6 +691,7 @@ static errcode_t read_bitmaps_range_prepare(ext2_filsys fs, int flags)
 
 cleanup:
 	if (flags & EXT2FS_BITMAPS_BLOCK) {
+		ext2fs_free_extents_invalidate(fs);
 		ext2fs_free_block_bitmap(fs->block_map);
 		fs->block_map = 0;
 	}
@@ -290,7 +713,6 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 	errcode_t retval = 0;
 	int block_nbytes = EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
 	int inode_nbytes = EXT2_INODES_PER_GROUP(fs->super) / 8;
-	int csum_flag;
 	unsigned int	cnt;
 	blk64_t	blk;
 	blk64_t	blk_itr = EXT2FS_B2C(fs, fs->super->s_first_data_block);
@@ -298,8 +720,6 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 	ext2_ino_t ino_itr = 1;
 	ext2_ino_t ino_cnt;
 
-	csum_flag = ext2fs_has_group_desc_csum(fs);
-
 	if (flags & EXT2FS_BITMAPS_BLOCK) {
 		retval = io_channel_alloc_buf(fs->io, 0, &block_bitmap);
 		if (retval)
@@ -361,33 +781,10 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 	ino_itr += ((blk64_t)start * (inode_nbytes << 3));
 	for (i = start; i <= end; i++) {
 		if (block_bitmap) {
-			blk = ext2fs_block_bitmap_loc(fs, i);
-			if ((csum_flag &&
-			     ext2fs_bg_flags_test(fs, i, EXT2_BG_BLOCK_UNINIT) &&
-			     ext2fs_group_desc_csum_verify(fs, i)) ||
-			    (blk >= ext2fs_blocks_count(fs->super)))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, block_bitmap);
-				if (retval) {
-					retval = EXT2_ET_BLOCK_BITMAP_READ;
-					goto cleanup;
-				}
-				/* verify block bitmap checksum */
-				if (!(fs->flags &
-				      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-				    !ext2fs_block_bitmap_csum_verify(fs, i,
-						block_bitmap, block_nbytes)) {
-					retval =
-					EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
-					goto cleanup;
-				}
-				if (!bitmap_tail_verify((unsigned char *) block_bitmap,
-							block_nbytes, fs->blocksize - 1))
-					*tail_flags |= EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
-			} else
-				memset(block_bitmap, 0, block_nbytes);
+			retval = read_group_bitmap(fs, i, 0, mutex != NULL,
+						   block_bitmap, tail_flags);
+			if (retval)
+				goto cleanup;
 			cnt = block_nbytes << 3;
 			unix_pthread_mutex_lock(mutex);
 			retval = ext2fs_set_block_bitmap_range2(fs->block_map,
@@ -398,34 +795,10 @@ static errcode_t read_bitmaps_range_start(ext2_filsys fs, int flags,
 			blk_itr += block_nbytes << 3;
 		}
 		if (inode_bitmap) {
-			blk = ext2fs_inode_bitmap_loc(fs, i);
-			if ((csum_flag &&
-			     ext2fs_bg_flags_test(fs, i, EXT2_BG_INODE_UNINIT) &&
-			     ext2fs_group_desc_csum_verify(fs, i)) ||
-			    (blk >= ext2fs_blocks_count(fs->super)))
-				blk = 0;
-			if (blk) {
-				retval = io_channel_read_blk64(fs->io, blk,
-							       1, inode_bitmap);
-				if (retval) {
-					retval = EXT2_ET_INODE_BITMAP_READ;
-					goto cleanup;
-				}
-
-				/* verify inode bitmap checksum */
-				if (!(fs->flags &
-				      EXT2_FLAG_IGNORE_CSUM_ERRORS) &&
-				    !ext2fs_inode_bitmap_csum_verify(fs, i,
-						inode_bitmap, inode_nbytes)) {
-					retval =
-					EXT2_ET_INODE_BITMAP_CSUM_INVALID;
-					goto cleanup;
-				}
-				if (!bitmap_tail_verify((unsigned char *) inode_bitmap,
-							inode_nbytes, fs->blocksize - 1))
-					*tail_flags |= EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
-			} else
-				memset(inode_bitmap, 0, inode_nbytes);
+			retval = read_group_bitmap(fs, i, 1, mutex != NULL,
+						   inode_bitmap, tail_flags);
+			if (retval)
+				goto cleanup;
 			cnt = inode_nbytes << 3;
 			unix_pthread_mutex_lock(mutex);
 			retval = ext2fs_set_inode_bitmap_range2(fs->inode_map,
@@ -450,16 +823,21 @@ static errcode_t read_bitmaps_range_end(ext2_filsys fs, int flags,
 {
 	errcode_t retval;
 
-	/* Mark group blocks for any BLOCK_UNINIT groups */
+	if (flags & EXT2FS_BITMAPS_BLOCK)
+		fs->flags &= ~EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
+	if (flags & EXT2FS_BITMAPS_INODE)
+		fs->flags &= ~EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
+	fs->flags |= tail_flags;
+
+	/*
+	 * Mark group blocks for any BLOCK_UNINIT groups.  With lazily
+	 * read bitmaps this reads in the groups holding their metadata.
+	 */
 	if (flags & EXT2FS_BITMAPS_BLOCK) {
 		retval = mark_uninit_bg_group_blocks(fs);
 		if (retval)
 			return retval;
-		fs->flags &= ~EXT2_FLAG_BBITMAP_TAIL_PROBLEM;
 	}
-	if (flags & EXT2FS_BITMAPS_INODE)
-		fs->flags &= ~EXT2_FLAG_IBITMAP_TAIL_PROBLEM;
-	fs->flags |= tail_flags;
 
 	return 0;
 }
@@ -467,6 +845,7 @@ static errcode_t read_bitmaps_range_end(ext2_filsys fs, int flags,
 static void read_bitmaps_cleanup_on_error(ext2_filsys fs, int flags)
 {
 	if (flags & EXT2FS_BITMAPS_BLOCK) {
+		ext2fs_free_extents_invalidate(fs);
 		ext2fs_free_block_bitmap(fs->block_map);
 		fs->block_map = 0;
 	}
@@ -495,102 +874,189 @@ static errcode_t read_bitmaps_range(ext2_filsys fs, int flags,
 	return retval;
 }
 
-#ifdef HAVE_PTHREAD
+struct lazy_prefetch_info {
+	ext2fs_generic_bitmap_64 lp_bmap;
+	dgrp_t		lp_grp_start;
+	dgrp_t		lp_grp_end;
+	mutex_t		*lp_mutex;
+};
+
+static void lazy_prefetch_thread(void *data)
+{
+	struct lazy_prefetch_info *lp = data;
+	dgrp_t		i;
+
+	/* A group that fails is marked as such; it is not fatal here */
+	for (i = lp->lp_grp_start; i <= lp->lp_grp_end; i++)
+		lazy_load_group(lp->lp_bmap, i, lp->lp_mutex);
+}
+
+/*
+ * Read in all groups of a lazily read bitmap with a thread per run of
+ * flex groups, for callers which ask for EXT2FS_BITMAPS_PREFETCH
+ * because they are about to scan most of the bitmap anyway.  Nothing
+ * is lost if this cannot be done: the groups left unloaded are read
+ * when they are used.
+ */
+static void prefetch_lazy_bitmap(ext2_filsys fs,
+				 ext2fs_generic_bitmap gen_bmap,
+				 int num_threads)
+{
+	ext2fs_generic_bitmap_64 bmap = (ext2fs_generic_bitmap_64) gen_bmap;
+	struct lazy_prefetch_info *infos = NULL;
+	mutex_t		*mutex = NULL;
+	unsigned	flexbg_size = 1U << fs->super->s_log_groups_per_flex;
+	dgrp_t		average_group;
+	int		i;
+
+	if (!bitmap_is_lazy(gen_bmap))
+		return;
+
+	if (num_threads < 0)
+		num_threads = rbt_num_cpus();
+	if ((unsigned) num_threads > fs->group_desc_count)
+		num_threads = fs->group_desc_count;
+	average_group = num_threads ? fs->group_desc_count / num_threads : 0;
+	if (ext2fs_has_feature_flex_bg(fs->super))
+		average_group = (average_group / flexbg_size) * flexbg_size;
+	if (num_threads <= 1 || average_group == 0)
+		return;
+
+	if (ext2fs_get_arrayzero(num_threads, sizeof(*infos), &infos))
+		return;
+	if (rbt_mutex_create(&mutex))
+		goto out;
+
+	for (i = 0; i < num_threads; i++) {
+		infos[i].lp_bmap = bmap;
+		infos[i].lp_mutex = mutex;
+		infos[i].lp_grp_start = average_group * i;
+		if (i == num_threads - 1)
+			infos[i].lp_grp_end = fs->group_desc_count - 1;
+		else
+			infos[i].lp_grp_end = average_group * (i + 1) - 1;
+	}
+	ext2fs_run_threads(lazy_prefetch_thread, infos, sizeof(*infos),
+			   num_threads);
+	rbt_mutex_destroy(mutex);
+out:
+	ext2fs_free_mem(&infos);
+}
+
+/*
+ * Set up the bitmaps to be read in group by group as they are used.
+ * With EXT2FS_BITMAPS_PREFETCH they are read in parallel up front if
+ * the channel allows it.
+ */
+static errcode_t read_bitmaps_lazy(ext2_filsys fs, int flags, int num_threads)
+{
+	errcode_t retval = 0;
+	int eager = 0, tail_flags = 0;
+	int prefetch = (flags & EXT2FS_BITMAPS_PREFETCH) &&
+		(fs->io->flags & CHANNEL_FLAGS_THREADS) && num_threads != 1;
+
+	flags &= ~EXT2FS_BITMAPS_PREFETCH;
+
+	retval = read_bitmaps_range_prepare(fs, flags);
+	if (retval)
+		return retval;
+
+	if (flags & EXT2FS_BITMAPS_BLOCK) {
+		retval = setup_lazy_bitmap(fs, fs->block_map, 0);
+		if (retval == 0 && !bitmap_is_lazy(fs->block_map))
+			eager |= EXT2FS_BITMAPS_BLOCK;
+		else if (retval == 0 && prefetch)
+			prefetch_lazy_bitmap(fs, fs->block_map, num_threads);
+	}
+	if (retval == 0 && (flags & EXT2FS_BITMAPS_INODE)) {
+		retval = setup_lazy_bitmap(fs, fs->inode_map, 1);
+		if (retval == 0 && !bitmap_is_lazy(fs->inode_map))
+			eager |= EXT2FS_BITMAPS_INODE;
+		else if (retval == 0 && prefetch)
+			prefetch_lazy_bitmap(fs, fs->inode_map, num_threads);
+	}
+
+	if (retval == 0 && eager)
+		retval = read_bitmaps_range_start(fs, eager, 0,
+						  fs->group_desc_count - 1,
+						  NULL, &tail_flags);
+	if (retval == 0)
+		retval = read_bitmaps_range_end(fs, flags, tail_flags);
+	if (retval)
+		read_bitmaps_cleanup_on_error(fs, flags);
+	return retval;
+}
+
 struct read_bitmaps_thread_info {
 	ext2_filsys	rbt_fs;
 	int		rbt_flags;
 	dgrp_t		rbt_grp_start;
 	dgrp_t		rbt_grp_end;
 	errcode_t	rbt_retval;
-	pthread_mutex_t *rbt_mutex;
+	mutex_t		*rbt_mutex;
 	int		rbt_tail_flags;
 };
 
-static void *read_bitmaps_thread(void *data)
+static void read_bitmaps_thread(void *data)
 {
 	struct read_bitmaps_thread_info *rbt = data;
 
 	rbt->rbt_retval = read_bitmaps_range_start(rbt->rbt_fs, rbt->rbt_flags,
 				rbt->rbt_grp_start, rbt->rbt_grp_end,
 				rbt->rbt_mutex, &rbt->rbt_tail_flags);
-	return NULL;
 }
-#endif
 
-errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
+/*
+ * Read the bitmaps with a thread per run of flex groups.  The threads
+ * read around the I/O cache (see read_group_bitmap()), so the cache
+ * setting of the channel is left alone.
+ */
+static errcode_t read_bitmaps_threads(ext2_filsys fs, int flags,
+				      int num_threads)
 {
-#ifdef HAVE_PTHREAD
-	pthread_attr_t	attr;
-	pthread_t *thread_ids = NULL;
+	rbt_thread_t *thread_ids = NULL;
 	struct read_bitmaps_thread_info *thread_infos = NULL;
-	pthread_mutex_t rbt_mutex = PTHREAD_MUTEX_INITIALIZER;
+	mutex_t *rbt_mutex = NULL;
 	errcode_t retval;
 	errcode_t rc;
 	unsigned flexbg_size = 1U << fs->super->s_log_groups_per_flex;
 	dgrp_t average_group;
-	int i, tail_flags = 0;
-#endif
-
-	if (flags & ~EXT2FS_BITMAPS_VALID_FLAGS)
-		return EXT2_ET_INVALID_ARGUMENT;
-
-	if (ext2fs_has_feature_journal_dev(fs->super))
-		return EXT2_ET_EXTERNAL_JOURNAL_NOSUPP;
+	int i, started = 0, tail_flags = 0;
 
-	if (flags & EXT2FS_BITMAPS_WRITE)
-		return write_bitmaps(fs, flags & EXT2FS_BITMAPS_INODE,
-				     flags & EXT2FS_BITMAPS_BLOCK);
-
-#ifdef HAVE_PTHREAD
-	if (((fs->io->flags & CHANNEL_FLAGS_THREADS) == 0) ||
-	    (num_threads == 1) || (fs->flags & EXT2_FLAG_IMAGE_FILE))
-		goto fallback;
-
-#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_CONF)
 	if (num_threads < 0)
-		num_threads = sysconf(_SC_NPROCESSORS_CONF);
-#endif
-	/*
-	 * Guess for now; eventually we should probably define
-	 * ext2fs_get_num_cpus() and teach it how to get this info on
-	 * MacOS, FreeBSD, etc.
-	 * ref: https://stackoverflow.com/questions/150355
-	 */
-	if (num_threads < 0)
-		num_threads = 4;
+		num_threads = rbt_num_cpus();
 
 	if ((unsigned) num_threads > fs->group_desc_count)
 		num_threads = fs->group_desc_count;
-	average_group = fs->group_desc_count / num_threads;
+	average_group = num_threads ? fs->group_desc_count / num_threads : 0;
 	if (ext2fs_has_feature_flex_bg(fs->super)) {
 		average_group = (average_group / flexbg_size) * flexbg_size;
 	}
 	if ((num_threads <= 1) || (average_group == 0))
-		goto fallback;
+		return read_bitmaps_range(fs, flags, 0,
+					  fs->group_desc_count - 1);
 
-	io_channel_set_options(fs->io, "cache=off");
-	retval = pthread_attr_init(&attr);
+	retval = ext2fs_get_array(num_threads, sizeof(rbt_thread_t),
+				  &thread_ids);
 	if (retval)
 		return retval;
-
-	thread_ids = calloc(sizeof(pthread_t), num_threads);
-	if (!thread_ids)
-		return ENOMEM;
-
-	thread_infos = calloc(sizeof(struct read_bitmaps_thread_info),
-				num_threads);
-	if (!thread_infos)
+	retval = ext2fs_get_arrayzero(num_threads,
+				      sizeof(struct read_bitmaps_thread_info),
+				      &thread_infos);
+	if (retval)
+		goto out;
+	retval = rbt_mutex_create(&rbt_mutex);
+	if (retval)
 		goto out;
 
 	retval = read_bitmaps_range_prepare(fs, flags);
 	if (retval)
 		goto out;
 
-//	fprintf(stdout, "Multiple threads triggered to read bitmaps\n");
 	for (i = 0; i < num_threads; i++) {
 		thread_infos[i].rbt_fs = fs;
 		thread_infos[i].rbt_flags = flags;
-		thread_infos[i].rbt_mutex = &rbt_mutex;
+		thread_infos[i].rbt_mutex = rbt_mutex;
 		thread_infos[i].rbt_tail_flags = 0;
 		if (i == 0)
 			thread_infos[i].rbt_grp_start = 0;
@@ -601,49 +1067,68 @@ errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
 			thread_infos[i].rbt_grp_end = fs->group_desc_count - 1;
 		else
 			thread_infos[i].rbt_grp_end = average_group * (i + 1);
-		retval = pthread_create(&thread_ids[i], &attr,
-					&read_bitmaps_thread, &thread_infos[i]);
+		retval = rbt_thread_create(&thread_ids[i], read_bitmaps_thread,
+					   &thread_infos[i]);
 		if (retval)
 			break;
+		started++;
 	}
-	for (i = 0; i < num_threads; i++) {
-		if (!thread_ids[i])
-			break;
-		rc = pthread_join(thread_ids[i], NULL);
-		if (rc && !retval)
-			retval = rc;
+	for (i = 0; i < started; i++) {
+		rbt_thread_join(thread_ids[i]);
 		rc = thread_infos[i].rbt_retval;
 		if (rc && !retval)
 			retval = rc;
 		tail_flags |= thread_infos[i].rbt_tail_flags;
 	}
-out:
-	rc = pthread_attr_destroy(&attr);
-	if (rc && !retval)
-		retval = rc;
-	free(thread_infos);
-	free(thread_ids);
 
 	if (retval == 0)
 		retval = read_bitmaps_range_end(fs, flags, tail_flags);
 	if (retval)
 		read_bitmaps_cleanup_on_error(fs, flags);
-	/* XXX should save and restore cache setting */
-	io_channel_set_options(fs->io, "cache=on");
+out:
+	if (rbt_mutex)
+		rbt_mutex_destroy(rbt_mutex);
+	ext2fs_free_mem(&thread_infos);
+	ext2fs_free_mem(&thread_ids);
 	return retval;
-fallback:
-#endif /* HAVE_PTHREAD */
-	return read_bitmaps_range(fs, flags, 0, fs->group_desc_count - 1);
+}
+
+errcode_t ext2fs_rw_bitmaps(ext2_filsys fs, int flags, int num_threads)
+{
+	if (flags & ~EXT2FS_BITMAPS_VALID_FLAGS)
+		return EXT2_ET_INVALID_ARGUMENT;
+
+	if (ext2fs_has_feature_journal_dev(fs->super))
+		return EXT2_ET_EXTERNAL_JOURNAL_NOSUPP;
+
+	if (flags & EXT2FS_BITMAPS_WRITE)
+		return write_bitmaps(fs, flags & EXT2FS_BITMAPS_INODE,
+				     flags & EXT2FS_BITMAPS_BLOCK);
+
+	if ((flags & EXT2FS_BITMAPS_LAZY) &&
+	    !(fs->flags & EXT2_FLAG_IMAGE_FILE))
+		return read_bitmaps_lazy(fs, flags & ~EXT2FS_BITMAPS_LAZY,
+					 num_threads);
+	flags &= ~(EXT2FS_BITMAPS_LAZY | EXT2FS_BITMAPS_PREFETCH);
+
+	if (((fs->io->flags & CHANNEL_FLAGS_THREADS) == 0) ||
+	    (num_threads == 1) || (fs->flags & EXT2_FLAG_IMAGE_FILE))
+		return read_bitmaps_range(fs, flags, 0,
+					  fs->group_desc_count - 1);
+
+	return read_bitmaps_threads(fs, flags, num_threads);
 }
 
 errcode_t ext2fs_read_inode_bitmap(ext2_filsys fs)
 {
-	return ext2fs_rw_bitmaps(fs, EXT2FS_BITMAPS_INODE, -1);
+	return ext2fs_rw_bitmaps(fs, EXT2FS_BITMAPS_INODE |
+				 EXT2FS_BITMAPS_LAZY, -1);
 }
 
 errcode_t ext2fs_read_block_bitmap(ext2_filsys fs)
 {
-	return ext2fs_rw_bitmaps(fs, EXT2FS_BITMAPS_BLOCK, -1);
+	return ext2fs_rw_bitmaps(fs, EXT2FS_BITMAPS_BLOCK |
+				 EXT2FS_BITMAPS_LAZY, -1);
 }
 
 errcode_t ext2fs_write_inode_bitmap(ext2_filsys fs)
@@ -666,7 +1151,7 @@ errcode_t ext2fs_read_bitmaps(ext2_filsys fs)
 		flags |= EXT2FS_BITMAPS_BLOCK;
 	if (flags == 0)
 		return 0;
-	return ext2fs_rw_bitmaps(fs, flags, -1);
+	return ext2fs_rw_bitmaps(fs, flags | EXT2FS_BITMAPS_LAZY, -1);
 }
 
 errcode_t ext2fs_write_bitmaps(ext2_filsys fs)
@@ -23,6 +23,9 @@ struct xnu_cache
 {
   char *buf;
   unsigned long long block;
+  unsigned long long tag;	/* what buf was last verified as */
+  io_verify_func verified_by;	/* the check buf passed, or NULL */
+  unsigned long seq;		/* bumped when buf or block changes */
   int access_time;
   unsigned int dirty : 1;
   unsigned int in_use : 1;
@@ -33,6 +36,12 @@ struct xnu_cache
 #define WRITE_DIRECT_SIZE       4
 #define READ_DIRECT_SIZE        4
 
+/* Locks taken when the channel is opened with IO_FLAG_THREADS */
+#define CACHE_MTX               0
+#define BOUNCE_MTX              1
+#define STATS_MTX               2
+#define NUM_MTX                 3
+
 struct xnu_private_data
 {
   int magic;
@@ -44,8 +53,23 @@ struct xnu_private_data
   struct xnu_cache cache[CACHE_SIZE];
   void *bounce;
   struct struct_io_stats io_stats;
+  lck_mtx_t *mtx[NUM_MTX];
 };
 
+static inline void
+mutex_lock (struct xnu_private_data *data, int kind)
+{
+  if (data->mtx[kind])
+    lck_mtx_lock (data->mtx[kind]);
+}
+
+static inline void
+mutex_unlock (struct xnu_private_data *data, int kind)
+{
+  if (data->mtx[kind])
+    lck_mtx_unlock (data->mtx[kind]);
+}
+
 #define IS_ALIGNED(n, align)					\
   ((((uintptr_t) n) & ((uintptr_t) ((align) - 1))) == 0)
 
@@ -65,7 +89,9 @@ raw_read_blk (io_channel channel, struct xnu_private_data *data,
   off_t llseek_off;
 
   size = count < 0 ? -count : (ext2_loff_t) count * channel->block_size;
+  mutex_lock (data, STATS_MTX);
   data->io_stats.bytes_read += size;
+  mutex_unlock (data, STATS_MTX);
   location = (ext2_loff_t) block * channel->block_size + data->offset;
 
   if (data->flags & IO_FLAG_FORCE_BOUNCE)
@@ -115,6 +141,7 @@ raw_read_blk (io_channel channel, struct xnu_private_data *data,
   offset = location % align_size;
   llseek_off = aligned_blk * align_size;
 
+  mutex_lock (data, BOUNCE_MTX);
   while (size > 0)
     {
       actual = vpread (data->vp, data->bounce, align_size, llseek_off);
@@ -122,6 +149,7 @@ raw_read_blk (io_channel channel, struct xnu_private_data *data,
 	llseek_off += actual;
       if (actual != align_size)
 	{
+	  mutex_unlock (data, BOUNCE_MTX);
 	  actual = really_read;
 	  buf -= really_read;
 	  size += really_read;
@@ -139,6 +167,7 @@ raw_read_blk (io_channel channel, struct xnu_private_data *data,
       offset = 0;
       aligned_blk++;
     }
+  mutex_unlock (data, BOUNCE_MTX);
 
  success:
   return 0;
@@ -173,7 +202,9 @@ raw_write_blk (io_channel channel, struct xnu_private_data *data,
     size = -count;
   else
     size = (ext2_loff_t) count * channel->block_size;
+  mutex_lock (data, STATS_MTX);
   data->io_stats.bytes_written += size;
+  mutex_unlock (data, STATS_MTX);
 
   location = (ext2_loff_t) block * channel->block_size + data->offset;
 
@@ -222,6 +253,7 @@ raw_write_blk (io_channel channel, struct xnu_private_data *data,
   aligned_blk = location / align_size;
   offset = location % align_size;
 
+  mutex_lock (data, BOUNCE_MTX);
   while (size > 0)
     {
       int actual_w;
@@ -233,6 +265,7 @@ raw_write_blk (io_channel channel, struct xnu_private_data *data,
 	    {
 	      if (actual < 0)
 		{
+		  mutex_unlock (data, BOUNCE_MTX);
 		  retval = EIO;
 		  goto error_out;
 		}
@@ -249,17 +282,22 @@ raw_write_blk (io_channel channel, struct xnu_private_data *data,
 			  aligned_blk * align_size);
       if (actual_w < 0)
 	{
+	  mutex_unlock (data, BOUNCE_MTX);
 	  retval = EIO;
 	  goto error_out;
 	}
       if (actual_w != align_size)
-	goto short_write;
+	{
+	  mutex_unlock (data, BOUNCE_MTX);
+	  goto short_write;
+	}
       size -= actual;
       buf += actual;
       location += actual;
       aligned_blk++;
       offset = 0;
     }
+  mutex_unlock (data, BOUNCE_MTX);
   return 0;
 
  error_out:
@@ -280,6 +318,8 @@ alloc_cache (io_channel channel, struct xnu_private_data *data)
   for (i = 0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
     {
       cache->block = 0;
+      cache->verified_by = NULL;
+      cache->seq++;
       cache->access_time = 0;
       cache->dirty = 0;
       cache->in_use = 0;
@@ -307,6 +347,8 @@ free_cache (struct xnu_private_data *data)
   for (i = 0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
     {
       cache->block = 0;
+      cache->verified_by = NULL;
+      cache->seq++;
       cache->access_time = 0;
       cache->dirty = 0;
       cache->in_use = 0;
@@ -317,6 +359,18 @@ free_cache (struct xnu_private_data *data)
     ext2fs_free_mem (&data->bounce);
 }
 
+static void
+free_mutexes (struct xnu_private_data *data)
+{
+  int i;
+  for (i = 0; i < NUM_MTX; i++)
+    {
+      if (data->mtx[i])
+	e2fsmac_mutex_free (data->mtx[i]);
+      data->mtx[i] = NULL;
+    }
+}
+
 #ifndef NO_IO_CACHE
 /*
  * Try to find a block in the cache.  If the block is not found, and
@@ -378,10 +432,44 @@ reuse_cache (io_channel channel, struct xnu_private_data *data,
   cache->dirty = 0;
   cache->write_err = 0;
   cache->block = block;
+  cache->verified_by = NULL;
+  cache->seq++;
   cache->access_time = ++data->access_time;
   return 0;
 }
 
+/*
+ * Drop the cached copies of blocks that a direct write went around,
+ * clean ones included, so that neither their old contents nor the
+ * result of an earlier check on them can be returned again.
+ */
+static void
+invalidate_cached_range (io_channel channel, struct xnu_private_data *data,
+			 unsigned long long block, int count)
+{
+  struct xnu_cache *cache;
+  unsigned long long end;
+  int i;
+
+  if (count < 0)
+    end = block + (-count + channel->block_size - 1) / channel->block_size;
+  else
+    end = block + count;
+
+  mutex_lock (data, CACHE_MTX);
+  for (i = 0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
+    {
+      if (!cache->in_use || cache->block < block || cache->block >= end)
+	continue;
+      cache->in_use = 0;
+      cache->dirty = 0;
+      cache->write_err = 0;
+      cache->verified_by = NULL;
+      cache->seq++;
+    }
+  mutex_unlock (data, CACHE_MTX);
+}
+
 #define FLUSH_INVALIDATE	0x01
 #define FLUSH_NOLOCK		0x02
 
@@ -398,6 +486,8 @@ flush_cached_blocks (io_channel channel, struct xnu_private_data *data,
   int i;
   int errors_found = 0;
 
+  if ((flags & FLUSH_NOLOCK) == 0)
+    mutex_lock (data, CACHE_MTX);
   for (i = 0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
     {
       if (!cache->in_use || !cache->dirty)
@@ -418,10 +508,14 @@ flush_cached_blocks (io_channel channel, struct xnu_private_data *data,
 	    cache->in_use = 0;
 	}
     }
+  if ((flags & FLUSH_NOLOCK) == 0)
+    mutex_unlock (data, CACHE_MTX);
 
  retry:
   while (errors_found)
     {
+      if ((flags & FLUSH_NOLOCK) == 0)
+	mutex_lock (data, CACHE_MTX);
       errors_found = 0;
       for (i = 0, cache = data->cache; i < CACHE_SIZE; i++, cache++)
 	{
@@ -440,6 +534,8 @@ flush_cached_blocks (io_channel channel, struct xnu_private_data *data,
 		err_buf = NULL;
 	      else
 		memcpy (err_buf, cache->buf, channel->block_size);
+	      if ((flags & FLUSH_NOLOCK) == 0)
+		mutex_unlock (data, CACHE_MTX);
 	      channel->write_error (channel, err_block, 1, err_buf,
 				    channel->block_size, -1, retval2);
 	      if (err_buf)
@@ -449,6 +545,8 @@ flush_cached_blocks (io_channel channel, struct xnu_private_data *data,
 	  else
 	    cache->write_err = 0;
 	}
+      if ((flags & FLUSH_NOLOCK) == 0)
+	mutex_unlock (data, CACHE_MTX);
     }
   return retval2;
 }
@@ -460,6 +558,7 @@ xnu_open (vnode_t vp, const char *name, int flags, io_channel *channel)
   io_channel io = NULL;
   struct xnu_private_data *data = NULL;
   errcode_t retval;
+  int i;
 
   retval = ext2fs_get_mem (sizeof (struct struct_io_channel), &io);
   if (retval)
@@ -494,6 +593,20 @@ xnu_open (vnode_t vp, const char *name, int flags, io_channel *channel)
   else
     io->flags |= CHANNEL_FLAGS_DISCARD_ZEROES;
 
+  if (flags & IO_FLAG_THREADS)
+    {
+      for (i = 0; i < NUM_MTX; i++)
+	{
+	  data->mtx[i] = e2fsmac_mutex_alloc ();
+	  if (unlikely (!data->mtx[i]))
+	    {
+	      retval = ENOMEM;
+	      goto cleanup;
+	    }
+	}
+      io->flags |= CHANNEL_FLAGS_THREADS;
+    }
+
   if ((retval = alloc_cache (io, data)))
     goto cleanup;
 
@@ -504,6 +617,7 @@ xnu_open (vnode_t vp, const char *name, int flags, io_channel *channel)
   if (data)
     {
       free_cache (data);
+      free_mutexes (data);
       ext2fs_free_mem (&data);
     }
   if (io)
@@ -533,6 +647,7 @@ xnu_close (io_channel channel)
 #endif
 
   free_cache (data);
+  free_mutexes (data);
   ext2fs_free_mem (&channel->private_data);
   if (channel->name)
     ext2fs_free_mem (&channel->name);
@@ -550,17 +665,22 @@ xnu_set_blksize (io_channel channel, int blksize)
   data = (struct xnu_private_data *) channel->private_data;
   EXT2_CHECK_MAGIC (data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
 
+  mutex_lock (data, CACHE_MTX);
   if (channel->block_size != blksize)
     {
 #ifndef NO_IO_CACHE
       if ((retval = flush_cached_blocks (channel, data, FLUSH_NOLOCK)))
-	return retval;
+	{
+	  mutex_unlock (data, CACHE_MTX);
+	  return retval;
+	}
 #endif
 
       channel->block_size = blksize;
       free_cache (data);
       retval = alloc_cache (channel, data);
     }
+  mutex_unlock (data, CACHE_MTX);
   return retval;
 }
 
@@ -595,6 +715,7 @@ xnu_read_blk64 (io_channel channel, unsigned long long block,
       return raw_read_blk (channel, data, block, count, buf);
     }
 
+  mutex_lock (data, CACHE_MTX);
   cp = buf;
   while (count > 0)
     {
@@ -624,7 +745,10 @@ xnu_read_blk64 (io_channel channel, unsigned long long block,
       log_debug ("Reading %d blocks starting at %llu\n", i, block);
 #endif
       if ((retval = raw_read_blk (channel, data, block, i, cp)))
-	return retval;
+	{
+	  mutex_unlock (data, CACHE_MTX);
+	  return retval;
+	}
 
       /* Save the results in the cache */
       for (j = 0; j < i; j++)
@@ -641,9 +765,11 @@ xnu_read_blk64 (io_channel channel, unsigned long long block,
 	  cp += channel->block_size;
 	}
     }
+  mutex_unlock (data, CACHE_MTX);
   return 0;
 
  call_write_handler:
+  mutex_unlock (data, CACHE_MTX);
   if (cache->write_err && channel->write_error)
     {
       char *err_buf = NULL;
@@ -672,6 +798,78 @@ xnu_read_blk (io_channel channel, unsigned long block, int count, void *buf)
   return xnu_read_blk64 (channel, block, count, buf);
 }
 
+/*
+ * Read one block and verify it, unless the cached copy has already
+ * passed the same check under the same tag.  The check itself runs
+ * with the cache unlocked, since it may read other blocks (such as
+ * the owning inode); the tag is then set only if the cache entry was
+ * not reused or written meanwhile.
+ */
+static errcode_t
+xnu_read_blk_verify (io_channel channel, unsigned long long block, void *buf,
+		     unsigned long long tag, io_verify_func verify, void *priv,
+		     int *verified)
+{
+  struct xnu_private_data *data;
+  struct xnu_cache *cache = NULL;
+  unsigned long seq = 0;
+  errcode_t retval;
+
+  EXT2_CHECK_MAGIC (channel, EXT2_ET_MAGIC_IO_CHANNEL);
+  data = (struct xnu_private_data *) channel->private_data;
+  EXT2_CHECK_MAGIC (data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+#ifndef NO_IO_CACHE
+  if (!(data->flags & IO_FLAG_NOCACHE))
+    {
+      mutex_lock (data, CACHE_MTX);
+      cache = find_cached_block (data, block, NULL);
+      if (cache && cache->verified_by == verify && cache->tag == tag)
+	{
+	  memcpy (buf, cache->buf, channel->block_size);
+	  mutex_unlock (data, CACHE_MTX);
+	  *verified = 1;
+	  return 0;
+	}
+      mutex_unlock (data, CACHE_MTX);
+    }
+#endif
+
+  if ((retval = xnu_read_blk64 (channel, block, 1, buf)))
+    return retval;
+
+#ifndef NO_IO_CACHE
+  if (!(data->flags & IO_FLAG_NOCACHE))
+    {
+      /* Check exactly the contents whose sequence number is known */
+      mutex_lock (data, CACHE_MTX);
+      cache = find_cached_block (data, block, NULL);
+      if (cache)
+	{
+	  memcpy (buf, cache->buf, channel->block_size);
+	  seq = cache->seq;
+	}
+      mutex_unlock (data, CACHE_MTX);
+
+      *verified = (*verify) (buf, priv);
+
+      if (cache && *verified)
+	{
+	  mutex_lock (data, CACHE_MTX);
+	  if (cache->in_use && cache->block == block && cache->seq == seq)
+	    {
+	      cache->tag = tag;
+	      cache->verified_by = verify;
+	    }
+	  mutex_unlock (data, CACHE_MTX);
+	}
+      return 0;
+    }
+#endif
+  *verified = (*verify) (buf, priv);
+  return 0;
+}
+
 static errcode_t
 xnu_write_blk64 (io_channel channel, unsigned long long block, int count,
 		 const void *buf)
@@ -700,7 +898,9 @@ xnu_write_blk64 (io_channel channel, unsigned long long block, int count,
     {
       if ((retval = flush_cached_blocks (channel, data, FLUSH_INVALIDATE)))
 	return retval;
-      return raw_write_blk (channel, data, block, count, buf, 0);
+      retval = raw_write_blk (channel, data, block, count, buf, 0);
+      invalidate_cached_range (channel, data, block, count);
+      return retval;
     }
 
   /*
@@ -712,6 +912,7 @@ xnu_write_blk64 (io_channel channel, unsigned long long block, int count,
   if (writethrough)
     retval = raw_write_blk (channel, data, block, count, buf, 0);
 
+  mutex_lock (data, CACHE_MTX);
   cp = buf;
   while (count > 0)
     {
@@ -726,14 +927,18 @@ xnu_write_blk64 (io_channel channel, unsigned long long block, int count,
 	}
       if (cache->buf != cp)
 	memcpy (cache->buf, cp, channel->block_size);
+      cache->verified_by = NULL;
+      cache->seq++;
       cache->dirty = !writethrough;
       count--;
       block++;
       cp += channel->block_size;
     }
+  mutex_unlock (data, CACHE_MTX);
   return retval;
 
  call_write_handler:
+  mutex_unlock (data, CACHE_MTX);
   if (cache->write_err && channel->write_error)
     {
       char *err_buf = NULL;
@@ -914,6 +1119,7 @@ static struct struct_io_manager struct_xnu_manager =
     .get_stats = xnu_get_stats,
     .discard = xnu_discard,
     .zeroout = xnu_zeroout,
+    .read_blk_verify = xnu_read_blk_verify,
   };
 
 io_manager xnu_io_manager = &struct_xnu_manager;